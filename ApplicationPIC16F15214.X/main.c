@@ -54,6 +54,10 @@ SOFTWARE.
  */
 #include "mcc_generated_files/mcc.h"
 
+// Define as the bootloader's WARM_ENTRY address (0x3F0) when running under a bootloader built with
+// EXTENDED_COMMANDS, to enter it without a reset.  Otherwise a stack overflow reset is used.
+//#define BOOTLOADER_WARM_ENTRY 0x3F0
+
 /*
                          Main application
  */
@@ -104,8 +108,12 @@ void main(void)
             if (input == 'J')
             {
                 INTERRUPT_GlobalInterruptDisable();
+#ifdef BOOTLOADER_WARM_ENTRY
+                ((void (*)(void))BOOTLOADER_WARM_ENTRY)();  // Straight to the handshake wait.  Does not return.
+#else
                 STKPTR = 0xF; // Max value
                 dummyFunction();  // Cause a stack reset.
+#endif
 
                 
             }
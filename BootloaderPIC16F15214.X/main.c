@@ -96,6 +96,206 @@ The bootloader will send the entire contents of the application flash area.
 10- Power cycle the micro to exit boot mode.
 
 
+Command line and emulator hosts:
+--------------------------------
+A command line version for Linux and scripted use, PIC16F15214Flash, is in the same folder as the C# app and
+shares the app's protocol code.  "PIC16F15214Flash --port /dev/ttyUSB0 --image app.hex" programs one board;
+several comma separated ports are programmed at once.  It prints one line of key=value results per port and
+exits with 0 on success, 1 if a board failed, 2 for a bad command line, 3 for a hex file that is unreadable,
+has nothing for the application area or is linked for another application start, 4 for a port error, 5 for a timeout and 6 if interrupted.
+
+PIC16F15214Emulator, also in that folder, models this bootloader behind a Linux pseudo-terminal so that hosts
+can be tried and timed without a board.  It prints the pty to open; --extended, --app-crc-check and
+--autoboot-window select the build options, and --realtime takes as long as the part would.  As on a board, closing
+the port does not reset the model, so the next host may find a session still running.  Hosts that set DTR or RTS when opening a port, as .Net's SerialPort does, need ptymodem.c
+from the same folder preloaded to open a pty.  PIC16F15214Emulator/test/regression.sh runs the command line host
+against the emulator, checking cases that have gone wrong before.  ptymodem.c keeps each pty's lines apart, so
+one process can reset a gang of emulators.
+
+
+Extended command session:
+-------------------------
+When built with EXTENDED_COMMANDS set to 1 the bootloader also accepts the sequence 0x52, 0xA3, 0x4D, 0xF7.
+The extended code does not fit below 0x140, so NEW_RESET_VECTOR moves to 0x400 and applications must be
+built with a matching Codeoffset.  Hosts that send 0xF6 still get the session described above.  A host that
+supports both should send 0xF7 again, skipping any banner, until it gets 'c'.  It should only fall back to 0xF6
+after 0xF7 has met silence more than once.  An extended bootloader also answers 0xF6.  That session's host
+still sends the area from 0x140, so the rows below 0x400 are acknowledged with 'W' but not written, and they
+are read back as 0x3FFF.  An application linked for 0x400 can then be loaded by a host that only knows 0xF6;
+one linked for 0x140 fails its verify instead of being written from the wrong address.
+
+The bootloader answers 0xF7 with 'c' followed by NEW_RESET_VECTOR (low byte, high byte) so the host knows
+where the application area starts.  It then waits for single character commands.  An unknown command, or an
+'S' with flags it does not support, is answered with '?'.
+
+The session lasts until reset, so the next host to open the port may find it running, perhaps at the rate
+an earlier host chose with 'B'.  A framing error or receiver overrun between commands puts the bootloader
+back to 16MHz and 115200.  A handshake sent while it waits for a command is answered with 'c' and
+NEW_RESET_VECTOR again, and the 'T' figures restart.  The handshake's 0x52 is also 'R', so an 'R' followed
+within a few milliseconds by 0xA3, 0x4D, 0xF7 is taken as a handshake, and one followed by anything else is
+answered with '?'.  A host that handshakes as described above, sending 0xF7 again until it gets 'c', is
+answered after at most a few attempts either way.
+
+* 'E' - Erase the application area, then send 'W'.
+
+* 'S' - Windowed write of the application area.  The command is followed by a flags byte, then each row is
+  sent as a sequence byte (row number modulo 128), the row's word address (low byte first) and 64 data bytes.
+  When a row has been received the bootloader sends XOFF (0x13), waits for it to leave the shift register,
+  commits the row, then sends an acknowledge byte (0x80 | sequence) and XON (0x11).  The host should send
+  each row only once the previous row's acknowledge has arrived: the acknowledge is the credit for one more
+  row, and the bootloader starts with one.  Then nothing reaches the UART while the row write stalls the CPU.
+  A host that sends further ahead relies on XOFF, and only up to two characters sent after it are held in the
+  UART FIFO.  A USB adapter may already have more than that queued in its transmit FIFO when it sees the
+  XOFF, so the PC app never does.  If the FIFO overruns the bootloader sends 'N' and (0x80 | expected
+  sequence), discards input until the line has been quiet for a few milliseconds, then sends XON.  The host
+  should flush its output and resend from the expected row.  Acknowledge and NAK bytes never equal XON or
+  XOFF, and a host may let its port drop XON and XOFF from its input.
+  Rows must be 32 word aligned, at or above NEW_RESET_VECTOR and below END_FLASH, or the packet is NAKed.  The
+  host only sends rows that hold part of its image, so transfer time depends on the size of the image rather
+  than the size of flash.  A packet with address 0xFFFF and no data ends the command and is acknowledged like a
+  row, and the bootloader waits for the next command.  Rows that are not sent are not touched.
+  Flags:
+  + 0x01 (WRITE_RESERVED) - Must be clear.
+  + 0x02 (WRITE_ADDRESSED) - Must be set, so that every packet carries its address.
+  + 0x04 (WRITE_SKIP_UNCHANGED) - Each row is compared with flash (NVMCON1bits.RD) as it is received, and is
+    only erased and written if it differs.  Every acknowledge is followed by 'W' if the row was rewritten or
+    'U' if it was unchanged.  This suits patching a fielded board (see 'H' for the order the rows must be
+    sent in).  Without 0x04 each row is written without being erased, so the host should send 'E' first.
+    That also erases the marker, so the board stays in boot until the row holding the marker is written.
+  + 0x08 (WRITE_ACK_CRC) - After the row is committed (or skipped) it is read back and its CRC, computed as
+    'C' would, follows the acknowledge (and the 'W'/'U' byte) as three bytes: 0x40 | bits 0-5, 0x40 | bits
+    6-11, 0x40 | bits 12-15.  The host checks each row as it is acknowledged, so no readback is needed
+    at the end of the session.
+  + 0x10 (WRITE_CHECKSUM) - Each packet, including the end of stream packet, ends with the CRC of the packet
+    (sequence byte, address, data) low byte first.  The CRC is checked while the host is paused, before the
+    row is erased or written.  A bad packet is NAKed like an out of order one, so the host resends from that
+    row and a corrupted byte costs one row instead of a full reflash.
+  + 0x20 (WRITE_RUN_LENGTH) - The 64 data bytes of each row are run-length encoded.  A word is sent low byte
+    first as usual, but if bit 7 of its high byte is set it is followed by a count byte (1 to WRITE_MAX_RUN),
+    and the word (with the high byte's top two bits cleared) is repeated that many times.  A run never crosses
+    a row.  The decoder expands each run straight into the row buffer as the bytes arrive, so no extra RAM
+    is needed.  With 0x10 the packet CRC covers the decoded 64 bytes, not the encoded ones.  Fill16 padding and
+    constant tables then cost three bytes per three words instead of six.  An overrun while a run is
+    expanded is NAKed like any other.
+
+  Rows are received into a 64 byte RAM buffer and loaded into the write latches while the host is paused.
+
+* 'R' - Send 'R' followed by the entire application area, as in step 7 above.  This is now a diagnostic;
+  use 'C' to verify.
+
+* 'C' - CRC of a flash range.  Followed by the start and end (exclusive) word addresses, each low byte
+  first.  The bootloader answers 'C' and the CRC-16/CCITT-FALSE (polynomial 0x1021, initial value 0xFFFF)
+  of the range, low byte first.  Each word is fed to the CRC low byte first, the same order as 'R' sends it,
+  so the host can compute the expected value from its image.  About 30 instructions per byte, so the whole
+  application area is checked in a fraction of the time it takes to send it.  A range that ends above
+  END_FLASH, or before it starts, is answered with '?' alone.  An empty range (start equal to end) gives 0xFFFF.
+
+* 'H' - Row hash map.  The bootloader answers 'H' followed by the CRC of each 32 word row from NEW_RESET_VECTOR
+  to END_FLASH, two bytes per row, low byte first.  Each CRC is computed exactly as 'C' would for that row.
+  The host compares these with its image and sends only the rows that differ, using 'S' with
+  WRITE_ADDRESSED and WRITE_SKIP_UNCHANGED, so the other rows are untouched.
+  Rows are rewritten in place, so the marker at 0xFFF would stay valid while the rows below it are a mix of
+  the old and new images.  A host that changes any other row must first send the row at 0xFE0 with 0xFFF
+  blank (0x3FFF), then the other rows, then the row at 0xFE0 as it should be.  A session that stops part way
+  then leaves the bootloader staying in boot with reason 'L'.
+
+  The same plan resumes an interrupted download.  Rows already written now match the image, and a row that
+  was erased but not written when the download stopped does not, so the next session's 'H' leads to
+  sending only what is still missing.  Neither side keeps any state between sessions,
+  so any host can resume, and the rows need not have been written in order.
+
+* 'I' - Device information.  The bootloader answers 'I', a count of the bytes that follow (12, so hosts
+  can skip fields added later), then:
+  + BOOTLOADER_VERSION
+  + bootloadReason, the reason it stayed in boot
+  + REVISIONID and DEVICEID, low byte first
+  + the three application words at APP_CRC_ADDRESS, low byte first: the image end and the check value's low
+    and high bytes (see Application image check).  The host writes these whether or not the bootloader checks
+    them, so a host whose image has the same end and check value only needs a 'C' to confirm the board is current.
+  It takes about 1.5mS at 115200, so a rack of boards can be inventoried without reading any flash.
+
+* 'T' - Timing.  Timer 1 free runs on LFINTOSC (31kHz, about 32uS per tick) from the end of the banner.  The
+  bootloader answers 'T', a count of the bytes that follow (26), the ticks from the banner to the handshake
+  (0xFFFF if over about 2 seconds), then for each phase its count of intervals, total ticks and longest
+  interval, each two bytes low byte first.  The phases are erase (each row actually erased), write (each row
+  committed), readback (each CRC over flash: 'C', 'H' and WRITE_ACK_CRC) and stall (XOFF to XON around each row
+  of 'S', which is how long the host was held off).  All figures restart at the handshake.  Totals wrap after
+  about 2 seconds of one phase.  Slow flash shows up as long erase and write times; a slow host or adapter
+  shows up as a write stream that takes much longer than its stalls.
+
+* 'B' - Change baud rate.  Followed by a rate code: 0 = 115200, 1 = 230400, 2 = 460800, 3 = 1000000.  The
+  bootloader measures Vdd and answers '!' if it is below 2.5V (or the code is unknown) and stays at 16MHz.
+  Otherwise it answers 'B', switches HFINTOSC to 32MHz and the UART to the new rate, and waits up to about
+  0.6 seconds for the host to send 'B' at the new rate.  It confirms with 'b'.  On a framing error, a wrong
+  character or a timeout it returns to 16MHz and 115200 without replying, so a host that gets no 'b' within
+  a second should go back to 115200.  The new rate lasts until reset, or until a framing error or overrun
+  while the bootloader waits for a command, such as a new host's handshake sent at 115200.  460800 is 2.1% fast with the 32MHz clock; 1000000 is exact.
+
+
+Auto-boot listen window:
+------------------------
+When built with AUTOBOOT_WINDOW_MS set (for example -DAUTOBOOT_WINDOW_MS=50) the bootloader listens for
+that many milliseconds after every reset that would otherwise jump to the application.  If 0x52, 0xA3, 0x4D
+followed by 0xF5, 0xF6 or 0xF7 arrives in that time it stays in boot with reason 'T' and sends EBOOTT>>.
+After 0xF6, or 0xF7 in an EXTENDED_COMMANDS build, it then starts that session, answering 'e' or 'c' straight
+after the banner.  A host that opened the port while the application was starting and sent its handshake once is
+still answered.  After anything else it waits for the handshake as usual.  Test fixtures can then reset a board and flash it without the application's
+help.  The PC app does this when "Reset target" is checked: it pulses DTR and RTS to reset the board, then
+sends 0x52, 0xA3, 0x4D, 0xF5 every 5mS until the banner arrives.  The 0xF5 form is only recognised in the
+window, so copies still in flight when the banner is sent are ignored.
+
+The cost is exactly the window, added to every boot into a valid application, and timed by Timer 1 on LFINTOSC
+(31kHz, so within its tolerance).  Bytes received before the window opens are discarded.  The window can be up
+to about 2000mS.  The default of 0 leaves the code out.  With a window set, the default build's code may no
+longer fit below 0x140.  The ROM range described under NEW_RESET_VECTOR then makes the link fail rather than
+overlap the application, and the extended configuration should be used instead.
+
+Warm entry from the application:
+--------------------------------
+An application running under a bootloader built with EXTENDED_COMMANDS can enter the bootloader by calling
+the fixed address WARM_ENTRY (NEW_RESET_VECTOR - 0x10, so 0x3F0) with interrupts disabled:
+\code{.unparsed}
+INTERRUPT_GlobalInterruptDisable();
+((void (*)(void))0x3F0)();  // Does not return
+\endcode
+Warm_Entry puts the clock, UART and pins back to the bootloader's settings and sends EBOOTA>> ('A' for
+application request), then waits for the handshake.  Compared with forcing a stack overflow reset (reason
+'S'), it skips the reset and the Vdd check, which can include a 100mS wait, so the
+bootloader is ready within the time it takes to send the banner.  The stack overflow method still works.
+
+Only a jump to the relocatable Warm_Start lives at 0x3F0, so the address stays fixed however the bootloader
+changes.  Build extended bootloaders with the project's "extended" configuration, which defines
+EXTENDED_COMMANDS=1 and limits the ROM range to default,-3F0-FFF: the linker then reports an error if the
+bootloader outgrows 0x3EF instead of placing code over the jump or the application's reset vector at 0x400.
+
+Application image check:
+------------------------
+When built with APP_CRC_CHECK set to 1 (which needs EXTENDED_COMMANDS) the bootloader checks the whole
+application image on every reset, not just its first and last words, and stays in boot with reason 'C' if it
+does not match.  The image carries three extra words, which the PC app fills in while it downloads:
+
+* 0xFFC (APP_CRC_ADDRESS) - End of the checked image, an exclusive word address: one past the highest word the
+  hex file defines below 0xFFC.
+* 0xFFD - Low byte of the check value.
+* 0xFFE - High byte of the check value.
+
+The check value is a Fletcher style sum of the words from NEW_RESET_VECTOR up to the end word, as 14 bit
+values read from flash: A and B start at 0, and for each word A += word and B += A, both modulo 0x10000.  The
+check value is B.  Gaps inside the image are programmed to 0x3FFF and are covered; rows above the end word are
+not.  The application must keep these words free by using -FFC-FFF instead of -FFF-FFF as its ROM ranges
+(below).
+
+The CRC that 'C' returns would catch every change to a single word, and the sum does not (a word changed by
+0x2000, eight words from the end of the image, leaves B as it was).  But the check is there for images that
+were erased, part written or written at the wrong address, which both catch, and a host that wants the
+stronger check still has 'C'.  The sum is far cheaper: two 16 bit adds per word instead of two
+Crc16_Update calls.  Counting the loop in Image_Sum instruction by instruction gives about 18 cycles per word
+(the flash read, the two adds, the 16 bit increment and compare of NVMADR and the branch), or up to about 30 if
+XC8 puts the sums outside common RAM and has to switch banks.  The CRC was estimated at 80 to 120.  At 16MHz an
+image that fills 0x400 to 0xFFC (3068 words) then takes about 14 to 23mS to check instead of 61 to 92mS.
+These are counts from the source, not measurements.  To measure, build the extended configuration with
+-DAPP_CRC_CHECK=1, load an image whose end word is 0xFFC into the MPLAB X simulator and run the stopwatch over
+the call of Image_Sum in Bootload_Required.
 
 Building a downloadable application:
 ------------------------------------
@@ -123,7 +323,7 @@ psect  resetstub,global,class=CODE,delta=2,abs
 
 This area must be reserved by the linker, or it will override any code in this area.  This is done in MPLAB X v5.40 by choosing project properties/XC8 global options / XC8 Global Options/ XC8 Linker / Memory Model and putting 
 -FFF-FFF
-in the "ROM ranges" box to remove that space from available area for allocation.
+(or -FFC-FFF for a bootloader built with APP_CRC_CHECK) in the "ROM ranges" box to remove that space from available area for allocation.
 
 Before using this bootloader you should consider the device configuration settings in device_config.c  .  These are the settings that will be used for both the bootloader and application.  The application will NOT download new configuration byte settings.  For instance, if your application requires a permanently turned on watchdog, then the config bits (and this bootloader) will need to be modified.  
 
@@ -143,14 +343,95 @@ The built application now has no reset vector or interrupt vector at the address
 /// End address of flash programming area (exclusive)
 #define END_FLASH                0x1000
 
+/// Set to 1 to build the extended command session (see main page).  The project's "extended" configuration sets it, along with the ROM range that keeps the code below WARM_ENTRY.
+#ifndef EXTENDED_COMMANDS
+#define EXTENDED_COMMANDS        0
+#endif
+
+/// Set to 1 to check the application image against its stored check value on every reset (see main page).  Needs EXTENDED_COMMANDS.
+#ifndef APP_CRC_CHECK
+#define APP_CRC_CHECK            0
+#endif
+#if APP_CRC_CHECK && !EXTENDED_COMMANDS
+#error APP_CRC_CHECK needs EXTENDED_COMMANDS
+#endif
+
+/// Milliseconds to listen for the handshake after every reset before jumping to a valid application (see main page).  0 to jump at once.
+#ifndef AUTOBOOT_WINDOW_MS
+#define AUTOBOOT_WINDOW_MS       0
+#endif
+
+/// Word holding the end (exclusive word address) of the checked image.  The next two words hold the check value, low byte first, one byte per word.
+#define APP_CRC_ADDRESS          0xFFC
+
 /// The address (in words) in flash where the Application's reset vector will be placed.
+/// The default configuration links with -mrom=default,-140-FFF and the "extended" one with default,-3F0-FFF, so
+/// the linker reports an error if the bootloader outgrows the space below it.
+#if EXTENDED_COMMANDS
+#define  NEW_RESET_VECTOR        0x400
+#else
 #define  NEW_RESET_VECTOR        0x140 
+#endif
+
+/// The address (in words) the 0xF6 session's host sends the application area from, whatever NEW_RESET_VECTOR is.
+#define  LEGACY_RESET_VECTOR     0x140
 
 /// The address (in words) in flash where the Application's interrupt handler or interrupt handler goto statement will be placed.
 #define  NEW_INTERRUPT_VECTOR    (NEW_RESET_VECTOR + 4)
+
+/// The address (in words) of Warm_Entry, which the application calls to enter the bootloader without a reset (EXTENDED_COMMANDS builds only).
+/// Warm_Entry is a jump of at most 4 words.  The "extended" configuration's ROM range (-mrom=default,-3F0-FFF) keeps
+/// the rest of the bootloader below it, so the linker fails rather than let the code run into the application.
+#define  WARM_ENTRY              (NEW_RESET_VECTOR - 0x10)
 #define _str(x)  #x
 #define str(x)  _str(x)
 
+/// Software flow control characters used to pause the host while a row write stalls the CPU
+#define XON                      0x11
+#define XOFF                     0x13
+
+/// Version of the extended command session, reported by the 'I' command
+#define BOOTLOADER_VERSION       1
+
+/// Configuration space word addresses (NVMREGS set) of REVISIONID and DEVICEID, which follows it
+#define REVISIONID_ADDRESS       0x0005
+
+/// Phases timed for the 'T' command, by Timer 1 on LFINTOSC (31kHz, about 32uS per tick)
+#define PHASE_ERASE              0
+#define PHASE_WRITE              1
+#define PHASE_READBACK           2
+#define PHASE_STALL              3
+#define PHASES                   4
+
+/// ADRESH reading of the FVR (1.024V) against Vdd above which Vdd is too low to run at 32MHz (Vdd < 2.5V)
+#define VDD_2V5_ADRESH           0x68
+
+/// RC1IF polls the command session makes for each byte after an 'R' before taking it as the 'R' command rather
+/// than the start of a handshake.  About ten instruction cycles each, so about 10mS at 16MHz and 5mS at 32MHz.
+/// A handshake's four bytes are sent in one write, so they arrive back to back.
+#define HANDSHAKE_POLLS          4096
+
+/// 'S' command flag, must be clear.  Was a per-row erase, which left the marker valid over a part written image.
+#define WRITE_RESERVED           0x01
+/// 'S' command flag, must be set: each row packet carries its word address, and only populated rows are sent
+#define WRITE_ADDRESSED          0x02
+/// 'S' command flag: compare each row with flash and only erase and write it if it differs
+#define WRITE_SKIP_UNCHANGED     0x04
+/// 'S' command flag: read each row back after it is committed and send its CRC with the acknowledge
+#define WRITE_ACK_CRC            0x08
+/// 'S' command flag: each row packet ends with a CRC, and a corrupted packet is NAKed before anything is written
+#define WRITE_CHECKSUM           0x10
+/// 'S' command flag: row data is run-length encoded, see WRITE_MAX_RUN
+#define WRITE_RUN_LENGTH         0x20
+/// Longest run of one word the host may encode with WRITE_RUN_LENGTH.  A run is expanded while the host keeps
+/// sending, so expanding it must take no longer than its three bytes take to arrive, or the UART falls further
+/// behind with every run until its two character FIFO overruns.  At 1000000 baud and 8 MIPS three bytes take
+/// 240 instruction cycles.  Reading the three bytes and testing for a run costs about 47 cycles and each word
+/// of the expansion about 45 (the flash read, two indexed stores, the banked compare, the NVMADR increment and
+/// the two loop tests), so 3 words take about 182 cycles, leaving 25% margin and the FIFO's two characters
+/// spare.  4 words (about 227 cycles) would leave almost no margin.  Slower rates have more time per byte.
+#define WRITE_MAX_RUN            3
+
 
 
 
@@ -171,6 +452,41 @@ uint8_t EUSART1_Read(void);
 void EUSART1_Write(uint8_t txData);
 uint8_t Bootload_Required(void);
 void Run_Bootloader(void);
+void Erase_Flash(void);
+void Erase_Row(uint16_t address);
+void Read_Flash(void);
+void EUSART1_Initialize(void);
+#if AUTOBOOT_WINDOW_MS
+uint8_t Listen_Window(void);
+#endif
+#if EXTENDED_COMMANDS
+void Warm_Entry(void) __at(WARM_ENTRY);
+void Warm_Start(void);
+uint8_t Row_Blank(void);
+void Command_Session(void);
+void Stream_Write(void);
+void Stream_Nak(uint8_t seq);
+uint8_t Stream_Read(void);
+void Pause_Host(void);
+void Resume_Host(uint8_t seq);
+void Write_Row(uint16_t address);
+uint16_t Packet_Crc(uint8_t seq, uint16_t row, uint8_t length);
+void Crc_Range(void);
+void Row_Hashes(void);
+void Crc_Flash(uint16_t end);
+void Set_Baud(void);
+void Default_Baud(void);
+void Session_Start(void);
+uint8_t Read_Or_Handshake(void);
+void Device_Info(void);
+void Phase_End(uint8_t phase, uint16_t start);
+void Send_Timing(void);
+void Send_Words(uint8_t count);
+void Crc16_Update(uint8_t data);
+#endif
+#if APP_CRC_CHECK
+uint16_t Image_Sum(uint16_t end);
+#endif
 
 /// \brief Global variable storing reason that the bootloader stayed in boot rather than jumping to the application
 /// 
@@ -180,8 +496,28 @@ void Run_Bootloader(void);
 /// * 'F' -  The first byte of flash in application was not programmed to non-erased value
 /// * 'S' -  The Stack Overflow indicator is set (application request to stay in boot)
 /// * 'V' -  The system voltage was less than 2.2 volts, indicating an external request to stay in boot.
+/// * 'C' -  The application image does not match its stored check value (APP_CRC_CHECK builds only)
+/// * 'A' -  The application called Warm_Entry (EXTENDED_COMMANDS builds only)
+/// * 'T' -  The host sent the handshake within AUTOBOOT_WINDOW_MS of reset
 uint8_t bootloadReason = 0;
 
+/// An array of bytes that is treated like a FIFO by the code.  This array stores the last 4 bytes received and compares them to a magic value to enter the bootloader.
+uint8_t startBytes[4];
+
+#if EXTENDED_COMMANDS
+/// Timer 1 ticks from the end of the banner to the handshake, 0xFFFF if more than about 2 seconds
+uint16_t handshakeTicks;
+/// Per phase Timer 1 totals, longest single interval and number of intervals since the handshake
+uint16_t phaseTotal[PHASES];
+uint16_t phaseMax[PHASES];
+uint16_t phaseCount[PHASES];
+/// Timer 1 when the host was last paused
+uint16_t pauseStart;
+/// Written with Warm_Entry's address by Run_Bootloader.  Only the application calls Warm_Entry, so without this
+/// reference garbage-collect-functions could drop it and leave WARM_ENTRY erased.
+void (* volatile warmEntryKeep)(void);
+#endif
+
 
 /// \brief Main Program
 /// The main program contains a flattening of a number of functions
@@ -194,6 +530,16 @@ uint8_t bootloadReason = 0;
 /// The Bootloader runs at 16MHz so that it can run down to 1.8V
 void main(void)
 {
+	//void OSCILLATOR_Initialize(void)
+	// First, so that the rest of initialization does not run on the 1MHz reset clock (RSTOSC)
+	{
+		// MFOEN disabled; LFOEN disabled; ADOEN disabled; HFOEN disabled; 
+		//OSCEN = 0x00;//Commented out to save flash due to match reset value
+		// FRQ 16_MHz; 
+		OSCFRQ = 0x04;
+		// TUN 0; 
+		//OSCTUNE = 0x00;//Commented out to save flash due to match reset value
+	}
 	CPCON = 0xC0;  // Turn on charge pump for low voltage analog operation.
 	// initialize the device
 
@@ -238,19 +584,11 @@ void main(void)
 			  INLVLx registers
 			  */
 			INLVLA = 0x3F;
-
-			RX1PPS = 0x03;   //RA4->EUSART1:RX1;    
-		}
-		//void OSCILLATOR_Initialize(void)
-		{
-			// MFOEN disabled; LFOEN disabled; ADOEN disabled; HFOEN disabled; 
-			//OSCEN = 0x00;//Commented out to save flash due to match reset value
-			// FRQ 16_MHz; 
-			OSCFRQ = 0x04;
-			// TUN 0; 
-			//OSCTUNE = 0x00;//Commented out to save flash due to match reset value
 		}
 
+		// The FVR and ADC are set up here rather than just before the conversion because both need time to
+		// settle, which the flash checks in Bootload_Required provide for free.  The EUSART is only set up
+		// once it is needed (EUSART1_Initialize).
 		//   void FVR_Initialize(void)
 		{
 			// FVREN enabled; ADFVR off; 
@@ -262,28 +600,14 @@ void main(void)
 			ADCON1 = 0x70;
 			ADCON0 = (0x1E << 2) | 0x01;  // Turn on, select FVR channel.
 		}
-		//void EUSART1_Initialize(void)
-		{
-			// Set the EUSART1 module to the options selected in the user interface.
-
-			// ABDOVF no_overflow; SCKP Non-Inverted; BRG16 16bit_generator; WUE disabled; ABDEN disabled; 
-			BAUD1CON = 0x08;
-
-			// SPEN enabled; RX9 8-bit; CREN enabled; ADDEN disabled; SREN disabled; 
-			RC1STA = 0x90;
-
-			// TX9 8-bit; TX9D 0; SENDB sync_break_complete; TXEN enabled; SYNC asynchronous; BRGH hi_speed; CSRC slave; 
-			TX1STA = 0x24;
-
-			// SPBRGL 34; 
-			SP1BRGL = 34;
-
-			// SPBRGH 0; 
-			// SP1BRGH = 0x00; //Commented out to save flash due to match reset value
-		}
-
         
         bootloadReason = Bootload_Required ();
+#if AUTOBOOT_WINDOW_MS
+		if (bootloadReason == 0)
+		{
+			bootloadReason = Listen_Window();
+		}
+#endif
         
 		if (bootloadReason != 0)
 		{
@@ -301,12 +625,110 @@ void main(void)
 
 }
 
-/// An array of bytes that is treated like a FIFO by the code.  This array stores the last 4 bytes received and compares them to a magic value to enter the bootloader.
-uint8_t startBytes[4];
+#if EXTENDED_COMMANDS
+/// \brief Warm entry from the application, at the fixed address WARM_ENTRY.
+/// Only a jump to Warm_Start (a page select, the call and a return: 3 words, 4 at most), so it fits the 16 words
+/// below NEW_RESET_VECTOR whatever the compiler makes of Warm_Start, which the linker places with the rest of the
+/// bootloader.  A call rather than an asm goto so that the compiler sees Warm_Start in the call graph;
+/// Warm_Start discards the return address along with the application's call stack.  Warm_Entry itself is kept
+/// by warmEntryKeep.
+void Warm_Entry(void) __at(WARM_ENTRY)
+{
+	Warm_Start();
+}
+
+/// Body of Warm_Entry.  Skips the reset and the Bootload_Required checks (including the possible 100ms
+/// low voltage wait) and goes straight to the banner and handshake wait.  The application may run its own clock
+/// and UART settings and pins, so the bootloader's are applied again, by Run_Bootloader for the UART; that is
+/// a few register writes.  The caller must have disabled interrupts.
+void Warm_Start(void)
+{
+	STKPTR = 0x1F;  // Discard the application's call stack, and Warm_Entry's return address
+	INTCON = 0;
+	OSCFRQ = 0x04;  // FRQ 16_MHz
+	while (!OSCSTATbits.HFOR);
+	FVRCON = 0x81;  // As main, for the 'B' command's Vdd check
+	ADCON1 = 0x70;
+	ADCON0 = (0x1E << 2) | 0x01;
+	bootloadReason = 'A';
+	startBytes[3] = 0;  // The application may have used this RAM
+	Run_Bootloader();
+}
+#endif
+
+/// Set up EUSART1 at 115200 on RA3 (RX).  Called only when the bootloader stays in boot or listens, so a boot
+/// straight into the application does not pay for it.
+void EUSART1_Initialize(void)
+{
+	RX1PPS = 0x03;   //RA4->EUSART1:RX1;    
+#if EXTENDED_COMMANDS
+	RC1STA = 0;     // Reset the receiver, clearing any overrun the application left before Warm_Entry
+	SP1BRGH = 0;
+#endif
+
+	// Set the EUSART1 module to the options selected in the user interface.
+
+	// ABDOVF no_overflow; SCKP Non-Inverted; BRG16 16bit_generator; WUE disabled; ABDEN disabled; 
+	BAUD1CON = 0x08;
+
+	// SPEN enabled; RX9 8-bit; CREN enabled; ADDEN disabled; SREN disabled; 
+	RC1STA = 0x90;
+
+	// TX9 8-bit; TX9D 0; SENDB sync_break_complete; TXEN enabled; SYNC asynchronous; BRGH hi_speed; CSRC slave; 
+	TX1STA = 0x24;
+
+	// SPBRGL 34; 
+	SP1BRGL = 34;
+
+	// SPBRGH 0; 
+	// SP1BRGH = 0x00; //Commented out to save flash due to match reset value (set above for Warm_Entry)
+}
+
+#if AUTOBOOT_WINDOW_MS
+/// \brief Listen for the handshake for AUTOBOOT_WINDOW_MS, timed by Timer 1 on LFINTOSC.  Returns 'T' if it arrived, else 0.
+/// The fourth byte may be 0xF5, 0xF6 or 0xF7.  An 0xF6 or 0xF7 handshake is left in startBytes, so Run_Bootloader
+/// starts that session straight after the banner and a host that sends the handshake once is answered.  0xF5 is
+/// cleared, so a host that repeats the 0xF5 form until it sees the banner cannot start a session by accident.
+uint8_t Listen_Window()
+{
+	EUSART1_Initialize();
+
+	TMR1H = (uint8_t)((0x10000 - AUTOBOOT_WINDOW_MS * 31UL) >> 8);  // LFINTOSC is 31kHz
+	TMR1L = (uint8_t)(0x10000 - AUTOBOOT_WINDOW_MS * 31UL);
+	PIR1bits.TMR1IF = 0;  // May be left set by the Vdd check
+	T1CLK = 4; // LFINTOSC
+	T1CON = 0x01; // Start timer
+	while (!PIR1bits.TMR1IF)
+	{
+		if (PIR1bits.RC1IF)
+		{
+			startBytes[0] = startBytes[1];
+			startBytes[1] = startBytes[2];
+			startBytes[2] = startBytes[3];
+			startBytes[3] = RC1REG;
+			if (startBytes[0] == 0x52 &&
+					startBytes[1] == 0xA3 &&
+					startBytes[2] == 0x4D &&
+					startBytes[3] >= 0xF5 && startBytes[3] <= 0xF7)
+			{
+				T1CON = 0;
+				if (startBytes[3] == 0xF5)
+				{
+					startBytes[3] = 0;  // Only a wake up: Run_Bootloader waits for a handshake
+				}
+				return ('T');
+			}
+		}
+	}
+	T1CON = 0;  // Shut off timer.
+	return (0);
+}
+#endif
 
 /// The bootloader programming executable.  This function is called if the Bootload_Required function indicates a bootload is required.
 void Run_Bootloader()
 { 
+	EUSART1_Initialize();
 	TRISA = 0x3B;   // Enable TX output
 	RA2PPS = 0x05;   //RA2->EUSART1:TX1;    
 	TX1REG = 'E'; // Indicate Bootloader Entry.  First transmit, so no need to delay.
@@ -317,39 +739,39 @@ void Run_Bootloader()
     EUSART1_Write(bootloadReason);
     EUSART1_Write('>');
     EUSART1_Write('>');
-    startBytes[3] = 0;
+#if EXTENDED_COMMANDS
+	warmEntryKeep = Warm_Entry;
+	// Timer 1 free runs from here for the 'T' command
+	TMR1H = 0;
+	TMR1L = 0;
+	PIR1bits.TMR1IF = 0;
+	T1CLK = 4; // LFINTOSC
+	T1CON = 0x03; // Start timer, 16 bit reads
+#endif
     
 	while (startBytes[0] != 0x52 ||
 			startBytes[1] != 0xA3 ||
 			startBytes [2] != 0x4D ||
+#if EXTENDED_COMMANDS
+			(startBytes[3] != 0xF6 && startBytes[3] != 0xF7))
+#else
 			startBytes[3] != 0xF6)
+#endif
 	{
 		startBytes[0] = startBytes[1];
 		startBytes[1] = startBytes[2];
 		startBytes[2] = startBytes[3];
 		startBytes[3] = EUSART1_Read();
 	}
-	TX1REG = 'e';   // Waited for receipt of at least 4 characters, so no need to delay. 
-
-	//void Erase_Flash ()
+#if EXTENDED_COMMANDS
+	if (startBytes[3] == 0xF7)
 	{
-		NVMADRL = (uint8_t)(NEW_RESET_VECTOR);
-		NVMADRH = (uint8_t)(NEW_RESET_VECTOR >>8);
-		for (uint16_t i=0; i < 0x1000; i+=32)
-		{
-
-			NVMCON1 = 0x94;       // Setup writes
-			StartWrite();
-
-			NVMADRL += ERASE_FLASH_BLOCKSIZE;
-			if (NVMADRL == 0x00)
-			{
-				++ NVMADRH;
-			}
-		}
-
+		Command_Session();  // Does not return
 	}
+#endif
+	EUSART1_Write('e');   // The banner may still be sending if the handshake came from Listen_Window
 
+	Erase_Flash();
 
 	TX1REG = 'W';  // Erase takes a long time, so no need for delay.
 
@@ -359,7 +781,7 @@ void Run_Bootloader()
 	{
 
 		NVMCON1 = 0xA4;       // Setup writes
-		NVMADR = NEW_RESET_VECTOR;
+		NVMADR = LEGACY_RESET_VECTOR;
 
 
 		while ((NVMADRH & 0x10) == 0) // Hard coded to value 0x1000
@@ -367,6 +789,18 @@ void Run_Bootloader()
 			NVMDATL = EUSART1_Read();
 			NVMDATH = EUSART1_Read();
 
+#if EXTENDED_COMMANDS
+			if (NVMADR < NEW_RESET_VECTOR)
+			{
+				// The host's rows below the application area are acknowledged but never written
+				if ((NVMADRL & 0x1F) == 0x1F)
+				{
+					EUSART1_Write('W');
+				}
+				++NVMADR;
+				continue;
+			}
+#endif
 			if ((NVMADRL & 0x1F) == 0x1F)  // 32 word boundary
 			{
 				NVMCON1bits.LWLO = 0;
@@ -381,32 +815,661 @@ void Run_Bootloader()
 			++NVMADR;
 		}
 
-		EUSART1_Write('R'); // Use EUSART1_Write because we need delay here.
+		Read_Flash();
+	}
+	while(1);
+
+}
+
+/// Erase every row from NEW_RESET_VECTOR to the end of flash.  In EXTENDED_COMMANDS builds rows that are
+/// already blank, such as every row of a factory fresh part, are only read, which takes microseconds instead of a
+/// multi-millisecond stall.  The default build has no room below 0x140 for the check.
+void Erase_Flash()
+{
+	uint16_t address = NEW_RESET_VECTOR;
+
+	while (address < END_FLASH)
+	{
+		Erase_Row(address);
+		address += ERASE_FLASH_BLOCKSIZE;
+	}
+}
+
+/// Erase the row at the given word address, unless it is already blank (EXTENDED_COMMANDS builds only).
+void Erase_Row(uint16_t address)
+{
+#if EXTENDED_COMMANDS
+	uint16_t start;
+
+	NVMADR = address;
+	if (Row_Blank())
+	{
+		return;
+	}
+	start = TMR1;
+#endif
+	NVMADR = address;
+	NVMCON1 = 0x94;       // Setup erase
+	StartWrite();
+#if EXTENDED_COMMANDS
+	Phase_End(PHASE_ERASE, start);
+#endif
+}
+
+#if EXTENDED_COMMANDS
+/// Read the row starting at NVMADR and return nonzero if every word is 0x3FFF.  NVMADR is left at the next row.
+uint8_t Row_Blank()
+{
+	uint8_t blank = 0xFF;
+
+	NVMCON1 = 0;
+	do
+	{
+		NVMCON1bits.RD = 1;
+		blank &= NVMDATL & (NVMDATH | 0xC0);
+		++NVMADR;
+	} while (NVMADRL & 0x1F);
+	return (blank == 0xFF);
+}
+#endif
+
+/// Send 'R' followed by the entire application area, low byte first.  In the 0xF6 session of an EXTENDED_COMMANDS
+/// build the words from LEGACY_RESET_VECTOR up to NEW_RESET_VECTOR are sent first as 0x3FFF, so the host gets back
+/// the area it sent, with the part that was never written blank.
+void Read_Flash()
+{
+	EUSART1_Write('R'); // Use EUSART1_Write because we need delay here.
+
+#if EXTENDED_COMMANDS
+	if (startBytes[3] == 0xF6)
+	{
+		NVMADR = LEGACY_RESET_VECTOR;
+		while (NVMADR != NEW_RESET_VECTOR)
+		{
+			EUSART1_Write(0xFF);
+			EUSART1_Write(0x3F);
+			++NVMADR;
+		}
+	}
+#endif
+	NVMCON1 = 0;
+	NVMADR = NEW_RESET_VECTOR;  
+	while ((NVMADRH & 0x10) == 0) // Hard coded to value 0x1000
+	{	      
+		NVMCON1bits.RD = 1;
+		EUSART1_Write(NVMDATL);
+		EUSART1_Write(NVMDATH);
+		++NVMADR;
+	}            
+}
+
+#if EXTENDED_COMMANDS
+/// \brief Extended command session, entered with the 0x52 0xA3 0x4D 0xF7 handshake.
+/// Reports the application start address, then executes single character commands until reset.  A host that
+/// opens the port on a board still in a session from an earlier host is answered too: a framing error or overrun
+/// means the earlier host left the UART at another rate, so the rate goes back to 115200, and a handshake sent
+/// at the session's rate is told from 'R' by Read_Or_Handshake and answered as the first one was.
+void Command_Session()
+{
+	uint8_t command;
 
-		//    void Read_Flash()
+	Session_Start();
+	while (1)
+	{
+		while (!PIR1bits.RC1IF);
+		if (RC1STAbits.FERR || RC1STAbits.OERR)
+		{
+			(void)RC1REG;  // Discard the character, clearing FERR
+			RC1STAbits.CREN = 0;  // Clear any overrun
+			RC1STAbits.CREN = 1;
+			Default_Baud();
+			continue;
+		}
+		command = RC1REG;
+		if (command == 'R')
 		{
+			command = Read_Or_Handshake();
+		}
+		switch (command)
+		{
+			case 'c':  // A new host's handshake
+				Session_Start();
+				break;
+
+			case 'E':
+				Erase_Flash();
+				EUSART1_Write('W');
+				break;
+
+			case 'S':
+				Stream_Write();
+				break;
+
+			case 'R':
+				Read_Flash();
+				break;
+
+			case 'C':
+				Crc_Range();
+				break;
+
+			case 'H':
+				Row_Hashes();
+				break;
+
+			case 'B':
+				Set_Baud();
+				break;
 
-			NVMCON1 = 0;
-			NVMADR = NEW_RESET_VECTOR;  
-			while ((NVMADRH & 0x10) == 0) // Hard coded to value 0x1000
-			{	      
+			case 'I':
+				Device_Info();
+				break;
+
+			case 'T':
+				Send_Timing();
+				break;
+
+			default:
+				EUSART1_Write('?');
+				break;
+		}
+	}
+}
+
+/// Running CRC-16/CCITT-FALSE value used by Crc16_Update
+uint16_t crc;
+
+/// Set by Stream_Read when the UART has overrun during the packet being received
+uint8_t overrun;
+
+/// One row of received data, low byte first, so the row can be compared before anything is erased.
+/// Persistent so that the startup code, which runs on the 1MHz reset clock, does not spend 1mS clearing it.
+__persistent uint8_t rowBuffer[WRITE_FLASH_BLOCKSIZE * 2];
+
+/// \brief Windowed write of the application area ('S' command).
+/// The host streams sequence-numbered, addressed rows without waiting for each acknowledge.  Each row is received
+/// into rowBuffer and compared with flash as it arrives.  XOFF is sent before the row is erased or committed
+/// so the host stops transmitting while the CPU is stalled and the UART cannot be serviced.
+void Stream_Write()
+{
+	uint8_t seq = 0;
+	uint8_t flags = EUSART1_Read();
+	uint16_t row;
+	uint8_t changed;
+	uint8_t i;
+	uint8_t low;
+	uint8_t high;
+	uint8_t count;
+	uint16_t packetCrc;
+
+	if ((flags & (WRITE_RESERVED | WRITE_ADDRESSED)) != WRITE_ADDRESSED)
+	{
+		EUSART1_Write('?');
+		return;
+	}
+	while (1)
+	{
+		overrun = 0;
+		if (Stream_Read() != seq)
+		{
+			Stream_Nak(seq);
+			continue;
+		}
+
+		row = Stream_Read();
+		row |= (uint16_t)Stream_Read() << 8;
+		if (row == 0xFFFF)  // End of stream
+		{
+			if (flags & WRITE_CHECKSUM)
+			{
+				packetCrc = Stream_Read();
+				packetCrc |= (uint16_t)Stream_Read() << 8;
+				if (Packet_Crc(seq, row, 0) != packetCrc)
+				{
+					Stream_Nak(seq);
+					continue;
+				}
+			}
+			EUSART1_Write(0x80 | seq);
+			EUSART1_Write(XON);
+			return;
+		}
+		if ((row & 0x1F) != 0 || row < NEW_RESET_VECTOR || row >= END_FLASH)
+		{
+			Stream_Nak(seq);  // Never write over the bootloader
+			continue;
+		}
+
+		// Receive the row, comparing it with what is already programmed
+		NVMADR = row;
+		NVMCON1 = 0;
+		changed = 0;
+		for (i = 0; i < WRITE_FLASH_BLOCKSIZE * 2; )
+		{
+			low = Stream_Read();
+			high = Stream_Read();
+			count = 1;
+			if ((flags & WRITE_RUN_LENGTH) && (high & 0x80))
+			{
+				count = Stream_Read();
+				high &= 0x3F;
+			}
+			do
+			{
 				NVMCON1bits.RD = 1;
-				EUSART1_Write(NVMDATL);
-				EUSART1_Write(NVMDATH);
+				rowBuffer[i] = low;
+				rowBuffer[i + 1] = high;
+				changed |= (uint8_t)(low ^ NVMDATL) | (uint8_t)((high ^ NVMDATH) & 0x3F);
 				++NVMADR;
-			}            
+				i += 2;
+			} while (--count != 0 && i < WRITE_FLASH_BLOCKSIZE * 2);
+		}
+		if (flags & WRITE_CHECKSUM)
+		{
+			packetCrc = Stream_Read();
+			packetCrc |= (uint16_t)Stream_Read() << 8;
+		}
+
+		Pause_Host();
+		if (overrun ||
+				((flags & WRITE_CHECKSUM) && Packet_Crc(seq, row, WRITE_FLASH_BLOCKSIZE * 2) != packetCrc))
+		{
+			Stream_Nak(seq);  // Overrun or corrupted in transit.  Nothing has been erased or written.
+			continue;
+		}
+		if (flags & WRITE_SKIP_UNCHANGED)
+		{
+			if (changed)
+			{
+				Erase_Row(row);
+				Write_Row(row);
+			}
 		}
+		else
+		{
+			Write_Row(row);
+		}
+		if (flags & WRITE_ACK_CRC)
+		{
+			NVMADR = row;
+			Crc_Flash(row + WRITE_FLASH_BLOCKSIZE);  // Read back what is now in flash
+		}
+
+		EUSART1_Write(0x80 | seq);
+		if (flags & WRITE_SKIP_UNCHANGED)
+		{
+			EUSART1_Write(changed ? 'W' : 'U');
+		}
+		if (flags & WRITE_ACK_CRC)
+		{
+			// Six bits per byte with bit 6 set, so no byte can be taken for XON or XOFF
+			EUSART1_Write(0x40 | ((uint8_t)crc & 0x3F));
+			EUSART1_Write(0x40 | ((uint8_t)(crc >> 6) & 0x3F));
+			EUSART1_Write(0x40 | (uint8_t)(crc >> 12));
+		}
+		seq = (seq + 1) & 0x7F;
+		Resume_Host(seq);
 	}
-	while(1);
+}
+
+/// CRC of a row packet as sent by the host: the sequence byte, the address, then the first length bytes of
+/// rowBuffer.  Computed while the host is paused, not as bytes arrive, so the receive loop stays short enough
+/// for the fastest baud rate.
+uint16_t Packet_Crc(uint8_t seq, uint16_t row, uint8_t length)
+{
+	uint8_t i;
+
+	crc = 0xFFFF;
+	Crc16_Update(seq);
+	Crc16_Update((uint8_t)row);
+	Crc16_Update((uint8_t)(row >> 8));
+	for (i = 0; i < length; ++i)
+	{
+		Crc16_Update(rowBuffer[i]);
+	}
+	return crc;
+}
+
+/// Load rowBuffer into the write latches and commit it to the row at the given word address.
+void Write_Row(uint16_t address)
+{
+	uint8_t i;
+	uint16_t start = TMR1;
 
+	NVMADR = address;
+	NVMCON1 = 0xA4;       // Setup writes
+	for (i = 0; i < WRITE_FLASH_BLOCKSIZE * 2; i += 2)
+	{
+		NVMDATL = rowBuffer[i];
+		NVMDATH = rowBuffer[i + 1];
+		if (i == WRITE_FLASH_BLOCKSIZE * 2 - 2)
+		{
+			NVMCON1bits.LWLO = 0;  // Last word: write the row
+		}
+		StartWrite();
+		++NVMADR;
+	}
+	Phase_End(PHASE_WRITE, start);
+}
+
+/// \brief Send what the host needs to identify the board and its application ('I' command).
+void Device_Info()
+{
+	EUSART1_Write('I');
+	EUSART1_Write(12);  // Bytes that follow
+	EUSART1_Write(BOOTLOADER_VERSION);
+	EUSART1_Write(bootloadReason);
+	NVMADR = REVISIONID_ADDRESS;
+	NVMCON1 = 0x40;  // NVMREGS: configuration space
+	Send_Words(2);
+	NVMADR = APP_CRC_ADDRESS;
+	NVMCON1 = 0;
+	Send_Words(3);
 }
 
+/// Send count words from NVMADR, in the space NVMCON1 selects, low byte first.
+void Send_Words(uint8_t count)
+{
+	do
+	{
+		NVMCON1bits.RD = 1;
+		EUSART1_Write(NVMDATL);
+		EUSART1_Write(NVMDATH);
+		++NVMADR;
+	} while (--count != 0);
+}
+
+/// SP1BRGL values at 32MHz (BRG16 and BRGH set) for the 'B' command rate codes 0 to 3:
+/// 115200 (+0.6%), 230400 (-0.8%), 460800 (+2.1%) and 1000000 (exact).
+const uint8_t baudDivisors[] = { 68, 34, 16, 7 };
+
+/// \brief Switch to 32MHz and a faster baud rate ('B' command).
+/// Vdd is measured first because the bootloader normally runs at 16MHz so that it works down to 1.8V.
+/// After answering 'B' at the old rate the bootloader switches and waits up to about 0.6 seconds for the host to
+/// send 'B' at the new rate.  A framing error, a wrong character or a timeout puts it back to 16MHz and 115200.
+void Set_Baud()
+{
+	uint8_t code = EUSART1_Read();
+	uint8_t ok;
+	uint8_t tries = 8;
+	uint16_t wait;
+
+	ADCON0bits.GO_nDONE = 1;
+	while (ADCON0bits.GO_nDONE)
+	{
+	}
+	if (code > 3 || ADRESH > VDD_2V5_ADRESH)
+	{
+		EUSART1_Write('!');
+		return;
+	}
+	EUSART1_Write('B');
+	NOP();  // Let TX1REG move into the shift register before testing TRMT
+	while (!TX1STAbits.TRMT);
+
+	OSCFRQ = 0x05;  // FRQ 32_MHz
+	while (!OSCSTATbits.HFOR);
+	SP1BRGL = baudDivisors[code];
+
+	while (tries--)
+	{
+		wait = 0;
+		while (++wait != 0)
+		{
+			if (PIR1bits.RC1IF)
+			{
+				ok = !RC1STAbits.FERR;
+				if (RC1REG == 'B' && ok)
+				{
+					EUSART1_Write('b');
+					return;
+				}
+				tries = 0;  // Garbage at the new rate.  Give up now.
+				break;
+			}
+		}
+	}
+	Default_Baud();
+}
+
+/// \brief Back to 16MHz and 115200, the rate every session starts at.
+void Default_Baud()
+{
+	OSCFRQ = 0x04;  // FRQ 16_MHz
+	SP1BRGL = 34;
+}
+
+/// \brief Send the CRC of a host-given flash range ('C' command).
+/// Crc_Flash runs until NVMADR reaches the end.  NVMADR is 15 bits, so it never reaches an end of 0x8000 or
+/// more, and only reaches one below the start after wrapping.  Ranges that do not lie within flash are answered with '?'.
+void Crc_Range()
+{
+	uint16_t start;
+	uint16_t end;
+
+	start = EUSART1_Read();
+	start |= (uint16_t)EUSART1_Read() << 8;
+	end = EUSART1_Read();
+	end |= (uint16_t)EUSART1_Read() << 8;
+	if (end > END_FLASH || end < start)
+	{
+		EUSART1_Write('?');
+		return;
+	}
+
+	NVMADR = start;
+	Crc_Flash(end);
+	EUSART1_Write('C');
+	EUSART1_Write((uint8_t)crc);
+	EUSART1_Write((uint8_t)(crc >> 8));
+}
+
+/// \brief Send the CRC of every application row ('H' command).
+/// Lets the host compare flash with its image and send only the rows that differ.
+void Row_Hashes()
+{
+	EUSART1_Write('H');
+	NVMADR = NEW_RESET_VECTOR;
+	while ((NVMADRH & 0x10) == 0) // Hard coded to value 0x1000
+	{
+		Crc_Flash(NVMADR + WRITE_FLASH_BLOCKSIZE);
+		EUSART1_Write((uint8_t)crc);
+		EUSART1_Write((uint8_t)(crc >> 8));
+	}
+}
+
+#if APP_CRC_CHECK
+/// Fletcher style sum of the words from NVMADR up to (not including) end, for the boot time image check (see main
+/// page).  Not a CRC, so that the check costs a few adds per word rather than two Crc16_Update calls.
+uint16_t Image_Sum(uint16_t end)
+{
+	uint16_t sumA = 0;
+	uint16_t sumB = 0;
+
+	NVMCON1 = 0;
+	while (NVMADR != end)
+	{
+		NVMCON1bits.RD = 1;
+		sumA += NVMDAT;
+		sumB += sumA;
+		++NVMADR;
+	}
+	return (sumB);
+}
+#endif
+
+/// Set crc to the CRC of flash from NVMADR up to (not including) end.  NVMADR is left at end.
+void Crc_Flash(uint16_t end)
+{
+	uint16_t start = TMR1;
+
+	crc = 0xFFFF;
+	NVMCON1 = 0;
+	while (NVMADR != end)
+	{
+		NVMCON1bits.RD = 1;
+		Crc16_Update(NVMDATL);
+		Crc16_Update(NVMDATH);
+		++NVMADR;
+	}
+	Phase_End(PHASE_READBACK, start);
+}
+
+/// Add one byte to crc.  Polynomial 0x1021 computed a byte at a time with shifts rather than a table or bit loop.
+void Crc16_Update(uint8_t data)
+{
+	crc = (crc >> 8) | (crc << 8);
+	crc ^= data;
+	crc ^= (crc & 0xFF) >> 4;
+	crc ^= crc << 12;
+	crc ^= (crc & 0xFF) << 5;
+}
+
+/// Send XOFF and wait until it has left the shift register, so the host stops before the CPU stalls.
+void Pause_Host()
+{
+	EUSART1_Write(XOFF);
+	NOP();  // Let TX1REG move into the shift register before testing TRMT
+	while (!TX1STAbits.TRMT);
+	pauseStart = TMR1;
+}
+
+/// Send XON after a stall, or NAK row seq if the host did not stop in time and the UART overran.
+void Resume_Host(uint8_t seq)
+{
+	if (RC1STAbits.OERR)
+	{
+		Stream_Nak(seq);
+	}
+	else
+	{
+		Phase_End(PHASE_STALL, pauseStart);
+		EUSART1_Write(XON);
+	}
+}
+
+/// Add the Timer 1 ticks since start to a phase's figures.  Intervals are under 2 seconds, so wrapping does not matter.
+void Phase_End(uint8_t phase, uint16_t start)
+{
+	uint16_t ticks = TMR1 - start;
+
+	phaseTotal[phase] += ticks;
+	if (ticks > phaseMax[phase])
+	{
+		phaseMax[phase] = ticks;
+	}
+	++phaseCount[phase];
+}
+
+/// \brief Send the timing figures ('T' command).
+void Send_Timing()
+{
+	uint8_t i;
+
+	EUSART1_Write('T');
+	EUSART1_Write(2 + PHASES * 6);  // Bytes that follow
+	EUSART1_Write((uint8_t)handshakeTicks);
+	EUSART1_Write((uint8_t)(handshakeTicks >> 8));
+	for (i = 0; i < PHASES; ++i)
+	{
+		EUSART1_Write((uint8_t)phaseCount[i]);
+		EUSART1_Write((uint8_t)(phaseCount[i] >> 8));
+		EUSART1_Write((uint8_t)phaseTotal[i]);
+		EUSART1_Write((uint8_t)(phaseTotal[i] >> 8));
+		EUSART1_Write((uint8_t)phaseMax[i]);
+		EUSART1_Write((uint8_t)(phaseMax[i] >> 8));
+	}
+}
+
+/// EUSART1_Read for the packets of the 'S' command.  Once the UART has overrun it receives nothing more until
+/// CREN is cleared, so EUSART1_Read would wait for ever.  Instead this sets overrun and returns 0 at once, and
+/// the rest of the packet is run through quickly and NAKed; Stream_Nak clears the overrun.
+/// \brief Answer a handshake: 'c' and the application start, with the 'T' figures restarted.
+void Session_Start()
+{
+	uint8_t i;
+
+	handshakeTicks = PIR1bits.TMR1IF ? 0xFFFF : TMR1;
+	EUSART1_Write('c');   // The banner may still be sending if the handshake came from Listen_Window
+	for (i = 0; i < PHASES; ++i)  // Not left to the startup code: the application may have used this RAM before Warm_Entry
+	{
+		phaseTotal[i] = 0;
+		phaseMax[i] = 0;
+		phaseCount[i] = 0;
+	}
+	EUSART1_Write((uint8_t)(NEW_RESET_VECTOR));
+	EUSART1_Write((uint8_t)(NEW_RESET_VECTOR >> 8));
+}
+
+/// \brief Tell the 'R' command from the 0x52 that starts a handshake.
+/// 'R' is always sent alone, and the rest of a handshake follows at once, so 'R' is returned if nothing arrives
+/// within HANDSHAKE_POLLS polls, 'c' if 0xA3 0x4D 0xF7 do, and '?' for anything else.
+uint8_t Read_Or_Handshake()
+{
+	uint16_t wait;
+
+	startBytes[3] = 0x52;
+	while (startBytes[0] != 0x52 ||
+			startBytes[1] != 0xA3 ||
+			startBytes[2] != 0x4D ||
+			startBytes[3] != 0xF7)
+	{
+		wait = HANDSHAKE_POLLS;
+		while (!PIR1bits.RC1IF)
+		{
+			if (--wait == 0)
+			{
+				return ((startBytes[3] == 0x52) ? 'R' : '?');
+			}
+		}
+		startBytes[0] = startBytes[1];
+		startBytes[1] = startBytes[2];
+		startBytes[2] = startBytes[3];
+		startBytes[3] = RC1REG;
+	}
+	return ('c');
+}
+uint8_t Stream_Read(void)
+{
+	while (!PIR1bits.RC1IF)
+	{
+		if (RC1STAbits.OERR)
+		{
+			overrun = 1;
+			return (0);
+		}
+	}
+	return RC1REG;
+}
+
+/// Report a lost or out of order row, discard input until the host has gone quiet, then release the host.
+void Stream_Nak(uint8_t seq)
+{
+	uint16_t quiet = 0;
+
+	RC1STAbits.CREN = 0;  // Clear any overrun
+	RC1STAbits.CREN = 1;
+	EUSART1_Write('N');
+	EUSART1_Write(0x80 | seq);
+	while (++quiet != 4000)  // A few milliseconds with no received characters
+	{
+		if (PIR1bits.RC1IF)
+		{
+			(void)RC1REG;
+			quiet = 0;
+		}
+	}
+	EUSART1_Write(XON);
+}
+#endif
+
 /// \brief  Determine whether we should stay in the bootloader or jump to app
 /// Jump to app will happen unless one of the following criteria is present:
 /// *  The first location in App space is unprogrammed (0x3FFF)
 /// *  The last location is App space is not the magic number 0x14B7
 /// *  The last reset was caused by a hardware stack overflow (indication from App that we should stay in boot)
 /// *  The voltage on Vdd is less than 2.2V across 2 samples 100ms Apart
+/// *  With APP_CRC_CHECK, the application image does not match its stored check value
 uint8_t Bootload_Required ()
 {
 
@@ -482,8 +1545,36 @@ uint8_t Bootload_Required ()
 			}
 			if (ADRESH > 0x77) {return ('V');};
 		}
-		return (0);
 	}
+
+#if APP_CRC_CHECK
+	// Check the application image against the check value stored with it.  Done last because it is the slowest check.
+	{
+		uint16_t end;
+		uint16_t stored;
+
+		NVMADR = APP_CRC_ADDRESS;
+		NVMCON1 = 0;
+		NVMCON1bits.RD = 1;
+		end = NVMDAT;
+		++NVMADR;
+		NVMCON1bits.RD = 1;
+		stored = NVMDATL;
+		++NVMADR;
+		NVMCON1bits.RD = 1;
+		stored |= (uint16_t)NVMDATL << 8;
+		if (end <= NEW_RESET_VECTOR || end > APP_CRC_ADDRESS)
+		{
+			return ('C');
+		}
+		NVMADR = NEW_RESET_VECTOR;
+		if (Image_Sum(end) != stored)
+		{
+			return ('C');
+		}
+	}
+#endif
+	return (0);
 }
 
 
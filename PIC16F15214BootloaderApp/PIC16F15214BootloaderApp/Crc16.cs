@@ -0,0 +1,31 @@
+﻿using System;
+
+namespace PIC16F15214BootloaderApp
+{
+    /// <summary>
+    ///  CRC-16/CCITT-FALSE (polynomial 0x1021, initial value 0xFFFF), matching Crc16_Update in the bootloader.
+    /// </summary>
+    static class Crc16
+    {
+        public const UInt16 Initial = 0xFFFF;
+
+        public static UInt16 Update(UInt16 crc, byte data)
+        {
+            crc = (UInt16)((crc >> 8) | (crc << 8));
+            crc ^= data;
+            crc ^= (UInt16)((crc & 0xFF) >> 4);
+            crc ^= (UInt16)(crc << 12);
+            crc ^= (UInt16)((crc & 0xFF) << 5);
+            return crc;
+        }
+
+        public static UInt16 Compute(ReadOnlySpan<byte> data, UInt16 crc = Initial)
+        {
+            foreach (byte b in data)
+            {
+                crc = Update(crc, b);
+            }
+            return crc;
+        }
+    }
+}
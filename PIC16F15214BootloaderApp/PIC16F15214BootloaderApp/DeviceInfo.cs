@@ -0,0 +1,45 @@
+﻿using System;
+
+namespace PIC16F15214BootloaderApp
+{
+    /// <summary>
+    ///  Reply to the bootloader's 'I' command.
+    /// </summary>
+    class DeviceInfo
+    {
+        public byte BootloaderVersion;
+        /// Why the bootloader stayed in boot, as in the EBOOTx>> banner
+        public char BootloadReason;
+        public UInt16 DeviceId;
+        public UInt16 RevisionId;
+        /// End (exclusive word address) of the checked application image, as stored on the device
+        public uint ImageEnd;
+        /// Application image check value (a Fletcher style sum) as stored on the device
+        public UInt16 ImageCheck;
+
+        /// <summary>
+        ///  Decode the bytes that follow 'I' and the count.  Bytes beyond the known fields are ignored.
+        /// </summary>
+        public static DeviceInfo Parse(byte[] reply)
+        {
+            if (reply.Length < 12)
+            {
+                throw new InvalidOperationException("Device information reply too short");
+            }
+            return new DeviceInfo
+            {
+                BootloaderVersion = reply[0],
+                BootloadReason = (char)reply[1],
+                RevisionId = (UInt16)(reply[2] | (reply[3] << 8)),
+                DeviceId = (UInt16)(reply[4] | (reply[5] << 8)),
+                ImageEnd = (uint)(reply[6] | (reply[7] << 8)),
+                ImageCheck = (UInt16)(reply[8] | (reply[10] << 8)),
+            };
+        }
+
+        public override string ToString()
+        {
+            return $"Device 0x{DeviceId:X4} rev 0x{RevisionId:X4}, bootloader v{BootloaderVersion}, reason '{BootloadReason}'";
+        }
+    }
+}
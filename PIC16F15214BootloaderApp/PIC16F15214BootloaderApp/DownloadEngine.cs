@@ -0,0 +1,870 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO.Ports;
+using System.Threading;
+using System.Threading.Tasks;
+using IntelHex;
+
+namespace PIC16F15214BootloaderApp
+{
+    /// <summary>
+    ///  What a download should do beyond writing the image.
+    /// </summary>
+    class DownloadOptions
+    {
+        /// Only compare the board with the image; nothing is erased or written
+        public bool CheckOnly;
+        /// Pulse DTR and RTS and wake the bootloader's listen window before the handshake
+        public bool ResetTarget;
+        /// Read the whole application area back instead of checking CRCs
+        public bool FullReadback;
+        /// Fetch the bootloader's 'T' figures into the result's timing
+        public bool DeviceTiming;
+    }
+
+    /// <summary>
+    ///  Outcome of a download.
+    /// </summary>
+    class DownloadResult
+    {
+        public string PortName;
+        public bool Success;
+        /// Last status reported, which says what failed if Success is false
+        public string Status;
+        /// The board already held the image and nothing was written
+        public bool AlreadyCurrent;
+        /// Reply to 'I', or null for a bootloader without the command session
+        public DeviceInfo Info;
+        /// Host and bootloader timing, or null if the session threw
+        public SessionTiming Timing;
+        /// Wall clock time of the whole session, set by GangDownload
+        public TimeSpan Elapsed;
+        /// What the session threw, if it did not finish, set by GangDownload
+        public Exception Exception;
+    }
+
+    /// <summary>
+    ///  A download's status line and position in its current range.  Immutable, so the latest one can be
+    ///  handed from the download's thread to the UI's without a lock.
+    /// </summary>
+    class DownloadProgress
+    {
+        public readonly string Status;
+        public readonly int Value;
+        public readonly int Minimum;
+        public readonly int Maximum;
+
+        public DownloadProgress(string status, int value, int minimum, int maximum)
+        {
+            Status = status;
+            Value = value;
+            Minimum = minimum;
+            Maximum = maximum;
+        }
+    }
+
+    /// <summary>
+    ///  Speaks the bootloader protocol over one serial port.  Nothing here touches the UI: state is reported
+    ///  through IProgress from whichever thread the download runs on, and a download can be cancelled between rows.
+    /// </summary>
+    class DownloadEngine
+    {
+        readonly SerialPort _port;
+
+        /// Baud rate the bootloader starts every session at
+        const int BootBaud = 115200;
+        /// Baud rates selected by the 'B' command's rate codes
+        static readonly int[] BaudRates = { 115200, 230400, 460800, 1000000 };
+        /// Rate code requested after the handshake.  The bootloader falls back to 115200 if it cannot run it.
+        const byte HighSpeedRateCode = 3;
+
+        /// How long DTR and RTS are held to reset the target
+        const int ResetPulseMs = 10;
+        /// Interval between wake sequences sent into the bootloader's listen window
+        const int WakeIntervalMs = 5;
+        /// How long after reset to keep sending wake sequences.  Covers initialization, the boot time image check and the window.
+        const int WakeTimeoutMs = 1000;
+
+        /// Application start (word address) of a bootloader that only supports the original session
+        const uint LegacyApplicationStart = FirmwareImage.LegacyApplicationStart;
+        /// Times the 0xF7 handshake is sent before giving up on a bootloader that answers without 'c'
+        const int CommandSessionAttempts = 8;
+        /// Silent replies to 0xF7 in a row that show the bootloader has no command session
+        const int SilentAttempts = 2;
+        /// Longest banner, EBOOTx>>, skipped while waiting for a handshake reply
+        const int BannerLength = 8;
+        /// ReadHandshakeReply result when nothing arrived
+        const int SilentReply = -1;
+        /// ReadHandshakeReply result when only a banner arrived
+        const int BannerReply = -2;
+        /// Rows the windowed write may have in flight before waiting for an acknowledge.  Each acknowledge is the
+        /// credit for one more row, so with one the bootloader never receives while a row write stalls it.  More
+        /// would rely on the adapter stopping within two characters of the bootloader's XOFF, which USB adapters
+        /// with transmit FIFOs do not promise.
+        const int WriteWindow = 1;
+        /// NAKs tolerated without an acknowledge in between before a windowed write gives up
+        const int MaxWriteRetries = 10;
+        /// 'S' flag, always set: each row packet carries its address and unpopulated rows are not sent
+        const byte WriteAddressed = 0x02;
+        /// 'S' flag: the bootloader only rewrites rows that differ from flash and says which it skipped
+        const byte WriteSkipUnchanged = 0x04;
+        /// 'S' flag: each acknowledge carries the CRC of the row as read back from flash
+        const byte WriteAckCrc = 0x08;
+        /// 'S' flag: each packet ends with a CRC so a corrupted row is NAKed and resent
+        const byte WriteChecksum = 0x10;
+        /// 'S' flag: row data is run-length encoded
+        const byte WriteRunLength = 0x20;
+        /// Longest run WriteRunLength may encode (WRITE_MAX_RUN in the bootloader, where the limit is cycle counted)
+        const int WriteMaxRun = 3;
+
+        /// Progress range while writing (byte addresses of the application area) and the position shown when idle
+        const int ProgressMinimum = 0x280;
+        const int ProgressMaximum = 0x1FFF;
+        const int ProgressIdle = 0x300;
+        /// Most readback bytes taken from the port per read
+        const int ReadbackBlock = 256;
+
+        /// Application start (word address) reported by the bootloader
+        uint _applicationStart = LegacyApplicationStart;
+
+        /// Where the download in progress reports to and what cancels it
+        IProgress<DownloadProgress> _progress = null;
+        CancellationToken _cancel;
+        /// Last status and progress reported
+        string _status = "";
+        int _value = ProgressIdle;
+        int _minimum = ProgressMinimum;
+        int _maximum = ProgressMaximum;
+        /// Block buffer for the readback, reused by every Verify
+        readonly byte[] _readback = new byte[ReadbackBlock];
+
+        public DownloadEngine(string portName)
+        {
+            _port = new SerialPort(portName, BootBaud, Parity.None, 8, StopBits.One);
+        }
+
+        public string PortName
+        {
+            get { return _port.PortName; }
+        }
+
+        /// <summary>
+        ///  Run Download on a thread of its own.  The session spends most of its time blocked in serial reads, so
+        ///  it is not given a pool thread that many concurrent sessions would exhaust.  Progress is reported from
+        ///  that thread, once per row, so the caller should keep the latest report and show it at its own pace
+        ///  rather than marshal every one.
+        /// </summary>
+        public Task<DownloadResult> DownloadAsync(Firmware firmware, DownloadOptions options,
+            IProgress<DownloadProgress> progress, CancellationToken cancel)
+        {
+            return Task.Factory.StartNew(() => Download(firmware, options, progress, cancel), cancel,
+                TaskCreationOptions.LongRunning, TaskScheduler.Default);
+        }
+
+        /// <summary>
+        ///  Program a hex file into the target.  Throws OperationCanceledException if cancelled and
+        ///  TimeoutException if the bootloader stops answering, and InvalidDataException, before anything is erased,
+        ///  if the file has nothing for the board's application area or is linked for another; the port is closed either way.  A write that was
+        ///  cancelled or timed out is finished by the next download, from this engine or any other host, since
+        ///  the rows it did write no longer differ from the image.
+        /// </summary>
+        public DownloadResult Download(Firmware firmware, DownloadOptions options,
+            IProgress<DownloadProgress> progress, CancellationToken cancel)
+        {
+            DownloadResult result = new DownloadResult();
+            result.PortName = _port.PortName;
+            result.Timing = new SessionTiming();
+            _progress = progress;
+            _cancel = cancel;
+            _minimum = ProgressMinimum;
+            _maximum = ProgressMaximum;
+
+            Report("Initiating...", ProgressIdle);
+            _port.BaudRate = BootBaud;
+            _port.Open();
+            _port.ReadTimeout = 2000;
+            // A board that loses power after sending XOFF never sends XON
+            _port.WriteTimeout = 2000;
+            try
+            {
+                result.Success = RunSession(firmware, options, result);
+            }
+            finally
+            {
+                _port.Close();
+            }
+            result.Status = _status;
+            return result;
+        }
+
+        private bool RunSession(Firmware firmware, DownloadOptions options, DownloadResult result)
+        {
+            SessionTiming timing = result.Timing;
+            if (options.ResetTarget && !ResetIntoBootloader())
+            {
+                Status("No bootloader banner after reset");
+                return false;
+            }
+            bool commandSession = InitiateCommandSession();
+            if (!commandSession && options.CheckOnly)
+            {
+                // The original session erases the application as soon as it starts
+                Status("No command session, so the board cannot be checked without erasing it");
+                return false;
+            }
+            if (!commandSession)
+            {
+                _applicationStart = LegacyApplicationStart;
+                // The handshake starts the erase, so an image with nothing to write must be refused before it
+                firmware.ForApplicationStart(_applicationStart);
+                InitiateDownload();
+            }
+            timing.Mark("Handshake");
+            FirmwareImage image = firmware.ForApplicationStart(_applicationStart);
+            HexData data = image.Data;
+            if (!commandSession)
+            {
+                Status("Erasing...");
+                WaitForEraseCompletion();
+                timing.Mark("Erase");
+                Status("Writing...");
+                SendHex(data, 64);
+                timing.Mark("Write");
+                bool verified = Verify(data);
+                timing.Mark("Verify");
+                return verified;
+            }
+
+            // A board whose stored image end and check value match this image only needs its flash checked
+            DeviceInfo info = ReadDeviceInfo();
+            result.Info = info;
+            timing.Mark("Device info");
+            if (options.CheckOnly)
+            {
+                bool matches;
+                if (options.FullReadback)
+                {
+                    SendCommand('R');
+                    matches = Verify(data);
+                }
+                else
+                {
+                    matches = VerifyCrc(data);
+                }
+                if (matches)
+                {
+                    Status($"Matches image.  {info}");
+                }
+                timing.Mark("Verify");
+                if (options.DeviceTiming)
+                {
+                    ReadDeviceTiming(timing);
+                }
+                return matches;
+            }
+            if (info != null && image.ImageEnd != 0 && info.ImageEnd == image.ImageEnd && info.ImageCheck == image.ImageCheck &&
+                !options.FullReadback && VerifyCrc(data))
+            {
+                Status($"Already current.  {info}");
+                result.AlreadyCurrent = true;
+                timing.Mark("Verify");
+                if (options.DeviceTiming)
+                {
+                    ReadDeviceTiming(timing);
+                }
+                return true;
+            }
+
+            SetBaud(HighSpeedRateCode);
+            timing.Mark("Baud change");
+
+            // Only rows whose hash differs from the image are sent.  Each is erased just before
+            // it is written, and every other row is left as it is.
+            // Each written row is read back and checked as it is acknowledged, so no separate
+            // verify pass is needed.  If nothing was written the whole image is checked by CRC.
+            // An interrupted download needs nothing special: the rows it wrote already match, and
+            // a row it erased but did not write differs, so the hashes plan the rest.  Meanwhile the
+            // marker is blank (see WriteOrder), so the board stays in boot.
+            List<uint> rows = ChangedRows(data, ReadRowHashes(), 64);
+            timing.Mark("Row hashes");
+            bool success;
+            if (options.FullReadback)
+            {
+                success = rows.Count == 0 || SendHexWindowed(WriteOrder(image, rows, 64), 64, WriteWindow, WriteSkipUnchanged);
+                if (success)
+                {
+                    timing.Mark("Write");
+                    SendCommand('R');
+                    success = Verify(data);
+                }
+            }
+            else if (rows.Count == 0)
+            {
+                success = VerifyCrc(data);
+            }
+            else
+            {
+                success = SendHexWindowed(WriteOrder(image, rows, 64), 64, WriteWindow, WriteSkipUnchanged | WriteAckCrc);
+                if (success)
+                {
+                    Status("Download Complete");
+                }
+            }
+            timing.Mark("Verify");
+            if (options.DeviceTiming)
+            {
+                ReadDeviceTiming(timing);
+            }
+            return success;
+        }
+
+        private void Report(string status, int value)
+        {
+            _status = status;
+            _value = value;
+            _progress?.Report(new DownloadProgress(_status, _value, _minimum, _maximum));
+        }
+
+        private void Status(string status)
+        {
+            Report(status, _value);
+        }
+
+        /// <summary>
+        ///  Fetch the bootloader's 'T' figures into the session's timing report.
+        /// </summary>
+        private void ReadDeviceTiming(SessionTiming timing)
+        {
+            SendCommand('T');
+            if (_port.ReadByte() == 'T')
+            {
+                byte[] reply = new byte[_port.ReadByte()];
+                ReadFully(reply, reply.Length);
+                timing.SetDeviceFigures(reply);
+            }
+        }
+
+        /// <summary>
+        ///  Reset the target by pulsing DTR and RTS, then send the wake sequence 0x52, 0xA3, 0x4D, 0xF5 into the
+        ///  listen window of a bootloader built with AUTOBOOT_WINDOW_MS until its banner arrives.  The session is
+        ///  then started with the normal handshake.
+        /// </summary>
+        private bool ResetIntoBootloader()
+        {
+            byte[] wakeSequence = { 0x52, 0xA3, 0x4D, 0xF5 };
+            string received = "";
+
+            _port.DtrEnable = true;
+            _port.RtsEnable = true;
+            Thread.Sleep(ResetPulseMs);
+            _port.DiscardInBuffer();
+            _port.DtrEnable = false;
+            _port.RtsEnable = false;
+
+            Stopwatch elapsed = Stopwatch.StartNew();
+            while (elapsed.ElapsedMilliseconds < WakeTimeoutMs)
+            {
+                _cancel.ThrowIfCancellationRequested();
+                _port.Write(wakeSequence, 0, 4);
+                Thread.Sleep(WakeIntervalMs);
+                received += _port.ReadExisting();
+                if (received.Contains("EBOOT"))
+                {
+                    // Let the rest of the banner and any wake sequences still in flight go by
+                    Thread.Sleep(50);
+                    _port.DiscardInBuffer();
+                    return (true);
+                }
+            }
+            return (false);
+        }
+
+        /// <summary>
+        ///  Send the 0xF6 handshake, which starts the original session and its erase.  Only called once 0xF7 has met
+        ///  silence, so the bootloader is one without the command session.
+        /// </summary>
+        private bool InitiateDownload()
+        {
+            byte[] startSequence = { 0x52, 0xA3, 0x4D, 0xF6 };
+            // byte[] startSequence = { 0x55 , 0xCC, 0x44, 0x80 };
+
+            _port.DiscardInBuffer();
+            _port.Write(startSequence, 0, 4);
+            int priorTimout = _port.ReadTimeout;
+            _port.ReadTimeout = 50; // 50 ms
+            try
+            {
+                return (ReadHandshakeReply() == 'e');
+            }
+            finally
+            {
+                _port.ReadTimeout = priorTimout;
+            }
+        }
+
+        /// <summary>
+        ///  Try to open an extended command session.  A bootloader built without it ignores the 0xF7 sequence, so
+        ///  false is only returned once SilentAttempts handshakes in a row have met silence, and the caller then
+        ///  falls back to InitiateDownload.  A bootloader with the session answers 'c' to any handshake it sees,
+        ///  so a lost handshake is simply sent again.  A banner shows a bootloader that has just entered boot, from
+        ///  its listen window for instance; an extended bootloader follows it with 'c', and one that needs a fresh
+        ///  handshake gets the next attempt.  Any other reply means the board cannot be identified, and falling back
+        ///  to 0xF6 could write the image at the wrong address into an extended bootloader, so TimeoutException is
+        ///  thrown instead.
+        /// </summary>
+        private bool InitiateCommandSession()
+        {
+            byte[] startSequence = { 0x52, 0xA3, 0x4D, 0xF7 };
+            bool unexplained = false;
+            int silent = 0;
+
+            int priorTimout = _port.ReadTimeout;
+            _port.ReadTimeout = 50; // 50 ms
+            try
+            {
+                for (int attempt = 0; attempt < CommandSessionAttempts; ++attempt)
+                {
+                    _cancel.ThrowIfCancellationRequested();
+                    _port.DiscardInBuffer();
+                    _port.Write(startSequence, 0, 4);
+                    int reply = ReadHandshakeReply();
+                    if (reply == 'c')
+                    {
+                        _applicationStart = (uint)_port.ReadByte();
+                        _applicationStart |= (uint)_port.ReadByte() << 8;
+                        return (true);
+                    }
+                    if (reply >= 0)
+                    {
+                        unexplained = true;
+                    }
+                    silent = (reply == SilentReply) ? silent + 1 : 0;
+                    if (silent >= SilentAttempts && !unexplained)
+                    {
+                        return (false);
+                    }
+                }
+            }
+            finally
+            {
+                _port.ReadTimeout = priorTimout;
+            }
+            throw new TimeoutException("The bootloader answered the handshake but did not start a session");
+        }
+
+        /// <summary>
+        ///  Read the reply to a handshake, skipping a banner (EBOOTx>>) that arrives first.  Returns the first byte
+        ///  after any banner, SilentReply if nothing arrived within the read timeout, or BannerReply if a banner
+        ///  arrived and nothing followed it.
+        /// </summary>
+        private int ReadHandshakeReply()
+        {
+            int reply = SilentReply;
+            try
+            {
+                reply = _port.ReadByte();
+                if (reply != 'E')
+                {
+                    return (reply);
+                }
+                reply = BannerReply;
+                int previous = 0;
+                for (int i = 1; i < BannerLength; ++i)
+                {
+                    int b = _port.ReadByte();
+                    if (b == '>' && previous == '>')
+                    {
+                        break;
+                    }
+                    previous = b;
+                }
+                return (_port.ReadByte());
+            }
+            catch (TimeoutException)
+            {
+                return (reply);
+            }
+        }
+
+        /// <summary>
+        ///  Ask the bootloader to move to a faster baud rate and follow it.  Returns false, with
+        ///  both sides back at 115200, if the bootloader refuses (low Vdd) or the new rate does not work.
+        /// </summary>
+        private bool SetBaud(byte rateCode)
+        {
+            _port.Write(new byte[] { (byte)'B', rateCode }, 0, 2);
+            if (_port.ReadByte() != 'B')
+            {
+                return (false);
+            }
+
+            // The bootloader has switched once its 'B' has left the shift register
+            _port.BaudRate = BaudRates[rateCode];
+            _port.DiscardInBuffer();
+            _port.Write(new byte[] { (byte)'B' }, 0, 1);
+            int priorTimout = _port.ReadTimeout;
+            _port.ReadTimeout = 1000; // Longer than the bootloader waits for confirmation
+            try
+            {
+                if (_port.ReadByte() == 'b')
+                {
+                    return (true);
+                }
+            }
+            catch (TimeoutException)
+            {
+            }
+            finally
+            {
+                _port.ReadTimeout = priorTimout;
+            }
+            _port.BaudRate = BootBaud;
+            _port.DiscardInBuffer();
+            return (false);
+        }
+
+        private void SendCommand(char command)
+        {
+            _port.Write(new byte[] { (byte)command }, 0, 1);
+        }
+
+        private bool WaitForEraseCompletion()
+        {
+
+            try
+            {
+                byte b = (byte)_port.ReadByte();
+                return (b == 'W');
+            }
+            catch
+            {
+                return (false);
+            }
+        }
+
+        private bool SendHex(HexData data, uint pagesize)
+        {
+            byte[] page = new byte[pagesize];
+            uint highestAddress = data.HighestAddress;
+            for (uint i = data.LowestAddress; i < highestAddress; i += pagesize)
+            {
+                _cancel.ThrowIfCancellationRequested();
+                data.CopyTo(i, page);
+                _port.Write(page, 0, (int)pagesize);
+                Report($"Writing... 0x{i:X2}", (int)i);
+
+                int b = _port.ReadByte();
+                if (b != (int)'W')
+                {
+                    return false;
+                }
+
+            }
+
+            return (true);
+        }
+
+        /// <summary>
+        ///  Ask the bootloader for its 'I' device information.  Returns null if the bootloader predates the command.
+        /// </summary>
+        private DeviceInfo ReadDeviceInfo()
+        {
+            SendCommand('I');
+            int b = _port.ReadByte();
+            if (b != 'I')
+            {
+                return null;  // '?'
+            }
+            byte[] reply = new byte[_port.ReadByte()];
+            ReadFully(reply, reply.Length);
+            return DeviceInfo.Parse(reply);
+        }
+
+        /// <summary>
+        ///  Read the bootloader's row hash map: one CRC-16 per 32 word row of the application area.
+        /// </summary>
+        private UInt16[] ReadRowHashes()
+        {
+            int rowCount = (int)((FirmwareImage.EndFlash - _applicationStart) / 32);
+            byte[] reply = new byte[rowCount * 2];
+
+            SendCommand('H');
+            if (_port.ReadByte() != 'H')
+            {
+                throw new InvalidOperationException("No response to row hash request");
+            }
+            ReadFully(reply, reply.Length);
+
+            UInt16[] hashes = new UInt16[rowCount];
+            for (int i = 0; i < rowCount; ++i)
+            {
+                hashes[i] = (UInt16)(reply[2 * i] | (reply[2 * i + 1] << 8));
+            }
+            return hashes;
+        }
+
+        /// <summary>
+        ///  Byte addresses of the rows of the padded image whose CRC differs from the device's row hash.
+        /// </summary>
+        private List<uint> ChangedRows(HexData data, UInt16[] hashes, uint pagesize)
+        {
+            List<uint> rows = new List<uint>();
+            byte[] row = new byte[pagesize];
+            for (int i = 0; i < hashes.Length; ++i)
+            {
+                uint address = _applicationStart * 2 + (uint)i * pagesize;
+                data.CopyTo(address, row);
+                if (Crc16.Compute(row) != hashes[i])
+                {
+                    rows.Add(address);
+                }
+            }
+            return rows;
+        }
+
+        /// <summary>
+        ///  The changed rows in the order they are written, each with the data it is written from.  Rows are
+        ///  rewritten one at a time, so if anything besides the row holding the marker changes, that row is
+        ///  written first with the marker blank and again at the end with it.  A download that stops part way
+        ///  then leaves the bootloader staying in boot ('L') rather than starting a mix of two images.
+        /// </summary>
+        private static List<KeyValuePair<uint, HexData>> WriteOrder(FirmwareImage image, List<uint> rows, uint pagesize)
+        {
+            uint markerRow = (FirmwareImage.MarkerAddress * 2) & ~(pagesize - 1);
+            List<KeyValuePair<uint, HexData>> order = new List<KeyValuePair<uint, HexData>>();
+            bool others = rows.Exists(address => address != markerRow);
+            if (others)
+            {
+                order.Add(new KeyValuePair<uint, HexData>(markerRow, image.Unmarked));
+            }
+            foreach (uint address in rows)
+            {
+                if (address != markerRow)
+                {
+                    order.Add(new KeyValuePair<uint, HexData>(address, image.Data));
+                }
+            }
+            if (others || rows.Contains(markerRow))
+            {
+                order.Add(new KeyValuePair<uint, HexData>(markerRow, image.Data));
+            }
+            return order;
+        }
+
+        /// <summary>
+        ///  Read exactly count bytes, subject to the port's ReadTimeout.
+        /// </summary>
+        private void ReadFully(byte[] buffer, int count)
+        {
+            int received = 0;
+            while (received < count)
+            {
+                received += _port.Read(buffer, received, count - received);
+            }
+        }
+
+        /// <summary>
+        ///  Write the given rows (byte address and the data to write there), in order, with the command session's
+        ///  addressed, checksummed, run-length encoded 'S' command.  Up to window
+        ///  rows are sent ahead of the last acknowledge.  XON/XOFF is enabled so that the port drops the
+        ///  bootloader's XON and XOFF from the input, and holds the host while a row is committed if the window
+        ///  is more than one.  A NAK rewinds to the row the bootloader expects.  The
+        ///  end-of-stream packet is counted as one more row.
+        /// </summary>
+        private bool SendHexWindowed(List<KeyValuePair<uint, HexData>> rows, uint pagesize, int window, byte flags)
+        {
+            byte[] packet = new byte[pagesize + 5];
+            byte[] rowData = new byte[pagesize];
+            byte[] ackCrc = new byte[3];
+            int next = 0;
+            int acked = 0;
+            int retries = 0;
+            int unchanged = 0;
+
+            Status("Writing...");
+            _port.Handshake = Handshake.XOnXOff;
+            try
+            {
+                _port.Write(new byte[] { (byte)'S', (byte)(flags | WriteAddressed | WriteChecksum | WriteRunLength) }, 0, 2);
+                while (acked <= rows.Count)
+                {
+                    _cancel.ThrowIfCancellationRequested();
+                    while (next <= rows.Count && next - acked < window)
+                    {
+                        int length = 3;
+                        uint row = (next == rows.Count) ? 0xFFFF : rows[next].Key / 2;
+                        packet[0] = (byte)(next & 0x7F);
+                        packet[1] = (byte)row;
+                        packet[2] = (byte)(row >> 8);
+                        UInt16 packetCrc = Crc16.Compute(new ReadOnlySpan<byte>(packet, 0, length));
+                        if (next < rows.Count)
+                        {
+                            // The packet CRC covers the row as the bootloader decodes it
+                            rows[next].Value.CopyTo(rows[next].Key, rowData);
+                            length += EncodeRuns(rowData, new Span<byte>(packet, 3, (int)pagesize));
+                            packetCrc = Crc16.Compute(rowData, packetCrc);
+                        }
+                        packet[length] = (byte)packetCrc;
+                        packet[length + 1] = (byte)(packetCrc >> 8);
+                        _port.Write(packet, 0, length + 2);
+                        ++next;
+                    }
+
+                    int b = _port.ReadByte();
+                    if (b == 'N')
+                    {
+                        int expected = _port.ReadByte() & 0x7F;
+                        if (expected != (acked & 0x7F) || ++retries > MaxWriteRetries)
+                        {
+                            return false;
+                        }
+                        // Drop what is still queued and give the bootloader time to see a quiet line
+                        _port.DiscardOutBuffer();
+                        Thread.Sleep(50);
+                        next = acked;
+                    }
+                    else if ((b & 0x80) != 0 && (b & 0x7F) == (acked & 0x7F))
+                    {
+                        retries = 0;  // Progress, so a long write on a noisy link is not given up
+                        if (acked < rows.Count)
+                        {
+                            if ((flags & WriteSkipUnchanged) != 0 && _port.ReadByte() == 'U')
+                            {
+                                ++unchanged;
+                            }
+                            uint address = rows[acked].Key;
+                            if ((flags & WriteAckCrc) != 0)
+                            {
+                                ReadFully(ackCrc, 3);
+                                UInt16 crc = (UInt16)((ackCrc[0] & 0x3F) | ((ackCrc[1] & 0x3F) << 6) | ((ackCrc[2] & 0x0F) << 12));
+                                UInt16 expected = Crc16.Compute(rows[acked].Value.Subarray(address, pagesize));
+                                if (crc != expected)
+                                {
+                                    Report($"Verify failed at row 0x{address:X2}, CRC expected 0x{expected:X4}, got 0x{crc:X4}", ProgressIdle);
+                                    return false;
+                                }
+                            }
+                            Report($"Writing... 0x{address:X2}, {unchanged} rows unchanged", (int)Math.Min(address, (uint)_maximum));
+                        }
+                        ++acked;
+                    }
+                    else
+                    {
+                        return false;
+                    }
+                }
+            }
+            finally
+            {
+                _port.Handshake = Handshake.None;
+            }
+
+            return (true);
+        }
+
+        /// <summary>
+        ///  Run-length encode a row for WriteRunLength and return the encoded length.  Two or more equal words
+        ///  become the word with bit 7 of its high byte set, followed by the count.  The unimplemented top
+        ///  bits of each high byte are cleared in row first, as the bootloader does when it expands a run.
+        ///  Never longer than the row itself.
+        /// </summary>
+        private static int EncodeRuns(Span<byte> row, Span<byte> encoded)
+        {
+            int length = 0;
+            for (int i = 1; i < row.Length; i += 2)
+            {
+                row[i] &= 0x3F;
+            }
+            for (int i = 0; i < row.Length; )
+            {
+                int run = 1;
+                while (run < WriteMaxRun && i + 2 * run < row.Length &&
+                    row[i + 2 * run] == row[i] && row[i + 2 * run + 1] == row[i + 1])
+                {
+                    ++run;
+                }
+                encoded[length++] = row[i];
+                if (run > 1)
+                {
+                    encoded[length++] = (byte)(row[i + 1] | 0x80);
+                    encoded[length++] = (byte)run;
+                }
+                else
+                {
+                    encoded[length++] = row[i + 1];
+                }
+                i += 2 * run;
+            }
+            return length;
+        }
+
+        /// <summary>
+        ///  Ask the bootloader for the CRC of the programmed range and compare it with the image,
+        ///  instead of reading the whole application area back.
+        /// </summary>
+        private bool VerifyCrc(HexData data)
+        {
+            uint lowestAddress = data.LowestAddress;
+            uint highestAddress = data.HighestAddress;
+            UInt16 expected = Crc16.Compute(data.Subarray(lowestAddress, highestAddress - lowestAddress + 1));
+            uint start = lowestAddress / 2;
+            uint end = (highestAddress + 1) / 2;
+            byte[] command = { (byte)'C', (byte)start, (byte)(start >> 8), (byte)end, (byte)(end >> 8) };
+
+            Status("Verifying...");
+            _port.Write(command, 0, command.Length);
+            if (_port.ReadByte() != 'C')
+            {
+                Status("Verify failed, no CRC response");
+                return (false);
+            }
+            UInt16 crc = (UInt16)_port.ReadByte();
+            crc |= (UInt16)(_port.ReadByte() << 8);
+            if (crc != expected)
+            {
+                Report($"Verify failed, CRC expected 0x{expected:X4}, got 0x{crc:X4}", ProgressIdle);
+                return (false);
+            }
+
+            Status("Download Complete");
+            return (true);
+        }
+
+        /// <summary>
+        ///  Check the bootloader's 'R' readback of the application area against the image.  The readback is taken
+        ///  in blocks, each read blocking until data arrives, and compared as it comes in; the first mismatch ends
+        ///  the check without waiting for the rest of the area.
+        /// </summary>
+        private bool Verify(HexData data)
+        {
+            uint highestAddress = data.HighestAddress;
+            uint lowestAddress = data.LowestAddress;
+            uint length = (highestAddress - lowestAddress + 1);
+
+            byte[] expected = data.Subarray(lowestAddress, length);
+            uint count = 0;
+            _port.ReadByte();   // 'R'
+            _minimum = (int)lowestAddress;
+            _maximum = (int)highestAddress + 1;
+            Report(_status, (int)lowestAddress);
+            while (count < length)
+            {
+                _cancel.ThrowIfCancellationRequested();
+                int received = _port.Read(_readback, 0, (int)Math.Min(length - count, (uint)_readback.Length));
+                for (int i = 0; i < received; ++i, ++count)
+                {
+                    if (_readback[i] != expected[count])
+                    {
+                        Report($"Verify failed at byte 0x{count + lowestAddress:X2}, expected 0x{expected[count]:X2}, got 0x{_readback[i]:X2}", ProgressIdle);
+                        return (false);
+                    }
+                }
+                Report($"Verifying... 0x{count:X2}", (int)(count + lowestAddress));
+            }
+
+            Status("Download Complete");
+            return (true);
+        }
+    }
+}
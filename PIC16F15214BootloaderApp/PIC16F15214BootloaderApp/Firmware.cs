@@ -0,0 +1,169 @@
+﻿using System;
+using System.Collections.Concurrent;
+using System.IO;
+using IntelHex;
+
+namespace PIC16F15214BootloaderApp
+{
+    /// <summary>
+    ///  A loaded hex file.  What the bootloader is sent depends on where its application starts, so the prepared
+    ///  image is built the first time a session asks for that start and shared by every session after it.  The
+    ///  file itself is never changed, so any number of downloads can use one Firmware at once.
+    /// </summary>
+    class Firmware
+    {
+        readonly HexData _hex;
+        readonly ConcurrentDictionary<uint, Lazy<FirmwareImage>> _images = new ConcurrentDictionary<uint, Lazy<FirmwareImage>>();
+
+        /// <summary>
+        ///  Load a hex file.  Throws InvalidDataException if it holds no valid records, since the loader skips lines it
+        ///  cannot parse and sending an empty image would leave the board erased.
+        /// </summary>
+        public Firmware(string filename)
+        {
+            Filename = filename;
+            _hex = new HexData(filename, true);
+            if (_hex.Count == 0)
+            {
+                throw new InvalidDataException("No Intel hex records found");
+            }
+        }
+
+        public string Filename { get; }
+
+        /// <summary>
+        ///  The image for a bootloader whose application starts at applicationStart (word address).  Throws
+        ///  InvalidDataException if the file has nothing in that application area, or is linked for another start.
+        /// </summary>
+        public FirmwareImage ForApplicationStart(uint applicationStart)
+        {
+            return _images.GetOrAdd(applicationStart,
+                start => new Lazy<FirmwareImage>(() => new FirmwareImage(_hex, start))).Value;
+        }
+    }
+
+    /// <summary>
+    ///  A hex file as the bootloader is sent it: cropped to the application area, with unused words filled with
+    ///  0x3FFF and the image end and check value stored at AppCrcAddress.  Nothing writes to Data or Unmarked once they are built.
+    /// </summary>
+    class FirmwareImage
+    {
+        /// End of flash (word address, exclusive)
+        public const uint EndFlash = 0x1000;
+        /// Application start (word address) of a bootloader built without EXTENDED_COMMANDS.  Words below it are
+        /// the stub vectors a hex file may carry for debugging, which are never sent.
+        public const uint LegacyApplicationStart = 0x140;
+        /// Word holding the end of the checked image, followed by the check value's low and high bytes (APP_CRC_ADDRESS)
+        public const uint AppCrcAddress = 0xFFC;
+        /// Word the bootloader checks for 0x14B7 before it starts the application
+        public const uint MarkerAddress = 0xFFF;
+
+        public readonly HexData Data = new HexData();
+        /// Data with the marker word blank, for the first write of the row that holds it
+        public readonly HexData Unmarked = new HexData();
+        /// Application start (word address) the image was cropped to
+        public readonly uint ApplicationStart;
+        /// End (exclusive word address) of the checked image, or 0 if the image uses the check words itself
+        public readonly uint ImageEnd;
+        /// Check value stored at AppCrcAddress, if ImageEnd is not 0
+        public readonly UInt16 ImageCheck;
+
+        /// <summary>
+        ///  Crop and fill hex for a bootloader whose application starts at applicationStart.  Throws
+        ///  InvalidDataException for an image linked for another start, which would otherwise be cropped into one
+        ///  that downloads and verifies but never runs: one with code between LegacyApplicationStart and
+        ///  applicationStart, or with no reset vector at applicationStart.
+        /// </summary>
+        public FirmwareImage(HexData hex, uint applicationStart)
+        {
+            if (applicationStart > LegacyApplicationStart &&
+                hex.ContainsAny(LegacyApplicationStart * 2, (applicationStart - LegacyApplicationStart) * 2))
+            {
+                throw new InvalidDataException(string.Format(
+                    "The image has code below the application start 0x{0:X}, so it is linked for another bootloader",
+                    applicationStart));
+            }
+            if (hex.ContainsAny(LegacyApplicationStart * 2, (EndFlash - LegacyApplicationStart) * 2) &&
+                !hex.ContainsAny(applicationStart * 2, 2))
+            {
+                throw new InvalidDataException(string.Format(
+                    "The image has no reset vector at the application start 0x{0:X}, so it is linked for another bootloader",
+                    applicationStart));
+            }
+            ApplicationStart = applicationStart;
+            Data.Add(ref hex);
+            Data.Crop(applicationStart * 2, EndFlash * 2);
+            if (Data.Count == 0)
+            {
+                throw new InvalidDataException(
+                    string.Format("No data in the application area 0x{0:X}-0x{1:X}", applicationStart, EndFlash - 1));
+            }
+            ImageEnd = FindImageEnd();
+            Data.Fill16(applicationStart * 2, EndFlash * 2, 0x3FFF);
+            if (ImageEnd != 0)
+            {
+                ImageCheck = StoreImageCheck();
+            }
+            HexData filled = Data;
+            Unmarked.Add(ref filled);
+            Unmarked[MarkerAddress * 2] = 0xFF;
+            Unmarked[MarkerAddress * 2 + 1] = 0x3F;
+            // Settle the cached bounds now, so later readers never update them
+            _ = Data.LowestAddress;
+            _ = Unmarked.LowestAddress;
+        }
+
+        /// <summary>
+        ///  End (exclusive word address) of the part of the cropped image that the check value stored for an
+        ///  APP_CRC_CHECK bootloader covers, or 0 if the image uses the check words itself.  Call before the image is filled.
+        /// </summary>
+        private uint FindImageEnd()
+        {
+            if (Data.ContainsAny(AppCrcAddress * 2, 6))
+            {
+                return 0;
+            }
+            for (uint address = AppCrcAddress * 2; address > ApplicationStart * 2; --address)
+            {
+                if (Data.Contains(address - 1))
+                {
+                    return (address + 1) / 2;
+                }
+            }
+            return 0;
+        }
+
+        /// <summary>
+        ///  Store the image end and the check value of the filled image up to it in the words at AppCrcAddress.
+        ///  Bootloaders built without APP_CRC_CHECK treat these as ordinary application words.  Returns the check value.
+        /// </summary>
+        private UInt16 StoreImageCheck()
+        {
+            UInt16 check = ImageSum(Data, ApplicationStart, ImageEnd);
+            uint address = AppCrcAddress * 2;
+            Data[address] = (byte)ImageEnd;
+            Data[address + 1] = (byte)(ImageEnd >> 8);
+            Data[address + 2] = (byte)check;
+            Data[address + 3] = 0;
+            Data[address + 4] = (byte)(check >> 8);
+            Data[address + 5] = 0;
+            return check;
+        }
+
+        /// <summary>
+        ///  The boot time check value of the words from start up to (not including) end, as Image_Sum in the
+        ///  bootloader computes it: A += word and B += A over the 14 bit words, both modulo 0x10000, giving B.
+        /// </summary>
+        private static UInt16 ImageSum(HexData data, uint start, uint end)
+        {
+            UInt16 sumA = 0;
+            UInt16 sumB = 0;
+            for (uint address = start; address < end; ++address)
+            {
+                sumA += (UInt16)((data[address * 2] | (data[address * 2 + 1] << 8)) & 0x3FFF);
+                sumB += sumA;
+            }
+            return sumB;
+        }
+    }
+}
@@ -33,6 +33,10 @@
             this.lState = new System.Windows.Forms.Label();
             this.progressBar1 = new System.Windows.Forms.ProgressBar();
             this.tbFilename = new System.Windows.Forms.TextBox();
+            this.cbFullReadback = new System.Windows.Forms.CheckBox();
+            this.cbResetTarget = new System.Windows.Forms.CheckBox();
+            this.cbTimingReport = new System.Windows.Forms.CheckBox();
+            this.tbPorts = new System.Windows.Forms.TextBox();
             this.SuspendLayout();
             // 
             // bSelectSerial
@@ -83,11 +87,55 @@
             this.tbFilename.Size = new System.Drawing.Size(232, 48);
             this.tbFilename.TabIndex = 4;
             // 
+            // cbFullReadback
+            // 
+            this.cbFullReadback.AutoSize = true;
+            this.cbFullReadback.Location = new System.Drawing.Point(130, 119);
+            this.cbFullReadback.Name = "cbFullReadback";
+            this.cbFullReadback.Size = new System.Drawing.Size(100, 19);
+            this.cbFullReadback.TabIndex = 5;
+            this.cbFullReadback.Text = "Full readback";
+            this.cbFullReadback.UseVisualStyleBackColor = true;
+            // 
+            // cbResetTarget
+            // 
+            this.cbResetTarget.AutoSize = true;
+            this.cbResetTarget.Location = new System.Drawing.Point(130, 15);
+            this.cbResetTarget.Name = "cbResetTarget";
+            this.cbResetTarget.Size = new System.Drawing.Size(88, 19);
+            this.cbResetTarget.TabIndex = 6;
+            this.cbResetTarget.Text = "Reset target";
+            this.cbResetTarget.UseVisualStyleBackColor = true;
+            // 
+            // cbTimingReport
+            // 
+            this.cbTimingReport.AutoSize = true;
+            this.cbTimingReport.Location = new System.Drawing.Point(39, 225);
+            this.cbTimingReport.Name = "cbTimingReport";
+            this.cbTimingReport.Size = new System.Drawing.Size(98, 19);
+            this.cbTimingReport.TabIndex = 7;
+            this.cbTimingReport.Text = "Timing report";
+            this.cbTimingReport.UseVisualStyleBackColor = true;
+            // 
+            // tbPorts
+            // 
+            this.tbPorts.Location = new System.Drawing.Point(39, 250);
+            this.tbPorts.Multiline = true;
+            this.tbPorts.Name = "tbPorts";
+            this.tbPorts.ReadOnly = true;
+            this.tbPorts.ScrollBars = System.Windows.Forms.ScrollBars.Vertical;
+            this.tbPorts.Size = new System.Drawing.Size(232, 100);
+            this.tbPorts.TabIndex = 8;
+            // 
             // Form1
             // 
             this.AutoScaleDimensions = new System.Drawing.SizeF(7F, 15F);
             this.AutoScaleMode = System.Windows.Forms.AutoScaleMode.Font;
-            this.ClientSize = new System.Drawing.Size(301, 252);
+            this.ClientSize = new System.Drawing.Size(301, 362);
+            this.Controls.Add(this.tbPorts);
+            this.Controls.Add(this.cbTimingReport);
+            this.Controls.Add(this.cbResetTarget);
+            this.Controls.Add(this.cbFullReadback);
             this.Controls.Add(this.tbFilename);
             this.Controls.Add(this.progressBar1);
             this.Controls.Add(this.lState);
@@ -107,6 +155,10 @@
         private System.Windows.Forms.Label lState;
         private System.Windows.Forms.ProgressBar progressBar1;
         private System.Windows.Forms.TextBox tbFilename;
+        private System.Windows.Forms.CheckBox cbFullReadback;
+        private System.Windows.Forms.CheckBox cbResetTarget;
+        private System.Windows.Forms.CheckBox cbTimingReport;
+        private System.Windows.Forms.TextBox tbPorts;
     }
 }
 
@@ -1,8 +1,10 @@
 ﻿using System;
-using System.IO.Ports;
+using System.Diagnostics;
+using System.Text;
+using System.Threading;
+using System.Threading.Tasks;
 using System.Windows.Forms;
 using WombatPanelWindowsForms;
-using IntelHex;
 
 /*
 MIT License
@@ -32,11 +34,46 @@ namespace PIC16F15214BootloaderApp
 {
     public partial class Form1 : Form
     {
-        SerialPort _port = null;
+        /// One engine per selected port.  With more than one, the ports are gang programmed.
+        DownloadEngine[] _engines = null;
         string _filename = null;
+
+        /// How often the window shows the download's latest progress
+        const int ProgressIntervalMs = 100;
+        /// Progress bar range while gang programming, which shows the least advanced port
+        const int GangProgressRange = 1000;
+
+        /// Set while a download runs; the Download button cancels it
+        CancellationTokenSource _cancelDownload = null;
+        /// Latest report from each port, and the last one shown
+        LatestProgress[] _latest = null;
+        DownloadProgress[] _shown = null;
+        readonly System.Windows.Forms.Timer _progressTimer = new System.Windows.Forms.Timer();
+
+        /// <summary>
+        ///  Keeps only the most recent report.  The download thread never waits for the window, which picks up
+        ///  whatever is here on its own timer.
+        /// </summary>
+        class LatestProgress : IProgress<DownloadProgress>
+        {
+            DownloadProgress _latest = null;
+
+            public void Report(DownloadProgress value)
+            {
+                Volatile.Write(ref _latest, value);
+            }
+
+            public DownloadProgress Take()
+            {
+                return Interlocked.Exchange(ref _latest, null);
+            }
+        }
+
         public Form1()
         {
             InitializeComponent();
+            _progressTimer.Interval = ProgressIntervalMs;
+            _progressTimer.Tick += (sender, e) => ShowProgress();
         }
 
         private void button1_Click(object sender, EventArgs e)
@@ -47,7 +84,14 @@ namespace PIC16F15214BootloaderApp
             {
                 try
                 {
-                    _port = new SerialPort(sps.SelectedPort, 115200, Parity.None, 8, StopBits.One);
+                    _engines = new DownloadEngine[sps.SelectedPorts.Length];
+                    _latest = new LatestProgress[_engines.Length];
+                    _shown = new DownloadProgress[_engines.Length];
+                    for (int i = 0; i < _engines.Length; ++i)
+                    {
+                        _engines[i] = new DownloadEngine(sps.SelectedPorts[i]);
+                        _latest[i] = new LatestProgress();
+                    }
 
                     bSelectSerial.Enabled = false;
                     bDownload.Enabled = true;
@@ -59,8 +103,14 @@ namespace PIC16F15214BootloaderApp
             }
         }
 
-        private void bDownload_Click(object sender, EventArgs e)
+        private async void bDownload_Click(object sender, EventArgs e)
         {
+            if (_cancelDownload != null)
+            {
+                _cancelDownload.Cancel();
+                return;
+            }
+
             OpenFileDialog ofd = new OpenFileDialog();
             if (_filename == null)
             {
@@ -72,148 +122,145 @@ namespace PIC16F15214BootloaderApp
             }
 
             if (_filename != null)
-
             {
-           //     try
-                {
-                    DownloadHex(_filename);
-                }
-               /* catch (TimeoutException)
-                {
-                    lState.Text = "Timeout";
-                    _port.Close();
-                }
-                catch (Exception ex)
-                {
-                    MessageBox.Show(ex.Message);
-                    lState.Text = "Exception Thrown";
-                    _port.Close();
-                }
-               */
+                await DownloadHex(_filename);
             }
-
-        }
-
-        private bool DownloadHex(string filename)
-        {
-            HexData data = new HexData(filename, true);
-            data.Crop(0x140 * 2, 0x1000 * 2);
-            data.Fill16(0x140 * 2, 0x1000 * 2, 0x3FFF);
-            progressBar1.Value = 0x300;
-            _port.Open();
-            _port.ReadTimeout = 2000;
-            lState.Text = "Initiating...";
-            this.Refresh();
-            InitiateDownload();
-            lState.Text = "Erasing...";
-            WaitForEraseCompletion();
-            lState.Text = "Writing...";
-            SendHex(data, 64);
-            Verify(data);
-            _port.Close();
-            return true;
         }
 
-        private bool InitiateDownload()
+        /// <summary>
+        ///  Run a download on every selected port at once.  The Download button becomes Cancel until all are done.
+        /// </summary>
+        private async Task DownloadHex(string filename)
         {
-            byte[] startSequence = { 0x52, 0xA3, 0x4D, 0xF6 };
-            // byte[] startSequence = { 0x55 , 0xCC, 0x44, 0x80 };
+            DownloadOptions options = new DownloadOptions();
+            options.ResetTarget = cbResetTarget.Checked;
+            options.FullReadback = cbFullReadback.Checked;
+            options.DeviceTiming = cbTimingReport.Checked;
 
-            _port.DiscardInBuffer();
-            _port.Write(startSequence, 0, 4);
-            int priorTimout = _port.ReadTimeout;
-            _port.ReadTimeout = 50; // 50 ms
+            Firmware firmware;
             try
             {
-                byte b = (byte)_port.ReadByte();
-                _port.ReadTimeout = priorTimout;
-                return (b == 'e');
+                firmware = await Task.Run(() => new Firmware(filename));
             }
-            catch
+            catch (Exception ex)
             {
-                _port.ReadTimeout = priorTimout;
-                return (false);
+                MessageBox.Show(ex.Message);
+                lState.Text = "Exception Thrown";
+                return;
             }
 
-        }
-
-        private bool WaitForEraseCompletion()
-        {
-
+            DownloadResult[] results;
+            Stopwatch elapsed = Stopwatch.StartNew();
+            _cancelDownload = new CancellationTokenSource();
+            bDownload.Text = "Cancel";
+            Array.Clear(_shown, 0, _shown.Length);
+            _progressTimer.Start();
             try
             {
-                byte b = (byte)_port.ReadByte();
-                return (b == 'W');
+                results = await GangDownload.DownloadAsync(_engines, firmware, options, _latest, _cancelDownload.Token);
             }
-            catch
+            finally
             {
-                return (false);
+                _progressTimer.Stop();
+                _cancelDownload.Dispose();
+                _cancelDownload = null;
+                bDownload.Text = "Download";
             }
+            ShowProgress();
+            ShowResults(results, elapsed.Elapsed);
         }
 
-        private bool SendHex(HexData data, uint pagesize)
+        /// <summary>
+        ///  Show how each port finished.  A single port keeps the status line to itself; a gang gets a summary there
+        ///  and one line per port below.
+        /// </summary>
+        private void ShowResults(DownloadResult[] results, TimeSpan elapsed)
         {
-            for (uint i = data.LowestAddress; i < data.HighestAddress; i += pagesize)
+            StringBuilder lines = new StringBuilder();
+            StringBuilder timing = new StringBuilder();
+            int programmed = 0;
+            foreach (DownloadResult result in results)
             {
-                _port.Write(data.Subarray(i, pagesize), 0, (int)pagesize);
-                lState.Text = $"Writing... 0x{i:X2}";
-                progressBar1.Value = (int)i;
-                this.Refresh();
-
-                int b = _port.ReadByte();
-                if (b != (int)'W')
+                if (result.Success)
                 {
-                    return false;
+                    ++programmed;
+                }
+                lines.AppendLine($"{result.PortName}  {result.Status}  {result.Elapsed.TotalSeconds:F1} s");
+                if (result.Timing != null)
+                {
+                    if (results.Length > 1)
+                    {
+                        timing.AppendLine($"{result.PortName}:");
+                    }
+                    timing.Append(result.Timing.ToString());
                 }
-
             }
-
-            return (true);
+            tbPorts.Text = lines.ToString();
+            if (results.Length == 1)
+            {
+                lState.Text = results[0].Status;
+            }
+            else
+            {
+                lState.Text = $"{programmed} of {results.Length} programmed in {elapsed.TotalSeconds:F1} s";
+            }
+            if (cbTimingReport.Checked && timing.Length > 0)
+            {
+                MessageBox.Show(timing.ToString(), "Session timing");
+            }
         }
 
-        private bool Verify(HexData data)
+        /// <summary>
+        ///  Show the latest progress reports, if there are new ones.
+        /// </summary>
+        private void ShowProgress()
         {
-            uint highestAddress = data.HighestAddress;
-            uint lowestAddress = data.LowestAddress;
-            uint length = (highestAddress - lowestAddress + 1);
-
-            byte[] incomingdata = new byte[length];
-            int count = 0;
-            byte Rbyte = (byte)_port.ReadByte();
-            progressBar1.Minimum = 0; progressBar1.Maximum = int.MaxValue;
-            progressBar1.Value = (int)lowestAddress;
-            progressBar1.Minimum = (int)lowestAddress;
-            progressBar1.Maximum = (int)highestAddress + 1;
-            while (count < length)
+            bool changed = false;
+            for (int i = 0; i < _latest.Length; ++i)
             {
-                if (_port.BytesToRead > 0)
+                DownloadProgress progress = _latest[i].Take();
+                if (progress != null)
                 {
-                    incomingdata[count] = (byte)_port.ReadByte();
-                    ++count;
-                    if ((count % 128) == 0 )
-                    {
-                        lState.Text = $"Verifying... 0x{count:X2}";
-                        progressBar1.Value = (int)(count + lowestAddress);
-                        this.Refresh();
-                    }
+                    _shown[i] = progress;
+                    changed = true;
                 }
             }
+            if (!changed)
+            {
+                return;
+            }
 
-            for (count = 0; count < length; ++count)
+            if (_shown.Length == 1)
+            {
+                ShowBar(_shown[0].Status, _shown[0].Value, _shown[0].Minimum, _shown[0].Maximum);
+                return;
+            }
+            StringBuilder lines = new StringBuilder();
+            int least = GangProgressRange;
+            for (int i = 0; i < _shown.Length; ++i)
             {
-                byte m = (byte)data.Memory[(uint)(count + lowestAddress)];
-                byte ic = incomingdata[count];
-                int address = (int)(count + lowestAddress) / 2;
-                if (m != ic)
+                DownloadProgress progress = _shown[i];
+                int position = 0;
+                if (progress != null && progress.Maximum > progress.Minimum)
                 {
-                    lState.Text = $"Verify failed at byte 0x{count + lowestAddress:X2}, expected 0x{m:X2}, got 0x{ic:X2}";
-                    progressBar1.Value = 0x300;
-                    return (false);
+                    position = (int)((long)(Math.Clamp(progress.Value, progress.Minimum, progress.Maximum) - progress.Minimum) *
+                        GangProgressRange / (progress.Maximum - progress.Minimum));
                 }
+                least = Math.Min(least, position);
+                lines.AppendLine($"{_engines[i].PortName}  {progress?.Status}");
             }
+            tbPorts.Text = lines.ToString();
+            ShowBar($"Programming {_shown.Length} boards...", least, 0, GangProgressRange);
+        }
 
-            lState.Text = "Download Complete";
-            return (true);
+        private void ShowBar(string status, int value, int minimum, int maximum)
+        {
+            lState.Text = status;
+            // Widen the range first so the new value and limits can be set in any order
+            progressBar1.Minimum = 0; progressBar1.Maximum = int.MaxValue;
+            progressBar1.Value = Math.Clamp(value, minimum, maximum);
+            progressBar1.Minimum = minimum;
+            progressBar1.Maximum = maximum;
         }
     }
 }
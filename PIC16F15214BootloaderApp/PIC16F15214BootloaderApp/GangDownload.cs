@@ -0,0 +1,66 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Threading;
+using System.Threading.Tasks;
+
+namespace PIC16F15214BootloaderApp
+{
+    /// <summary>
+    ///  Programs one Firmware into several boards at once, one DownloadEngine per port.  The sessions share
+    ///  nothing but the image and each runs on its own thread, so a panel takes about as long as its slowest
+    ///  board.  A board that fails or times out does not stop the others.
+    /// </summary>
+    static class GangDownload
+    {
+        /// <summary>
+        ///  Run every engine's download and collect the results in the same order.  progress holds one sink per
+        ///  engine, or is null.  A session that throws is reported as a failed result with the reason in Status.
+        /// </summary>
+        public static async Task<DownloadResult[]> DownloadAsync(IReadOnlyList<DownloadEngine> engines, Firmware firmware,
+            DownloadOptions options, IReadOnlyList<IProgress<DownloadProgress>> progress, CancellationToken cancel)
+        {
+            Task<DownloadResult>[] sessions = new Task<DownloadResult>[engines.Count];
+            for (int i = 0; i < engines.Count; ++i)
+            {
+                sessions[i] = Run(engines[i], firmware, options, progress?[i], cancel);
+            }
+            return await Task.WhenAll(sessions);
+        }
+
+        private static async Task<DownloadResult> Run(DownloadEngine engine, Firmware firmware,
+            DownloadOptions options, IProgress<DownloadProgress> progress, CancellationToken cancel)
+        {
+            Stopwatch elapsed = Stopwatch.StartNew();
+            Exception exception;
+            string status;
+            try
+            {
+                DownloadResult completed = await engine.DownloadAsync(firmware, options, progress, cancel);
+                completed.Elapsed = elapsed.Elapsed;
+                return completed;
+            }
+            catch (OperationCanceledException ex)
+            {
+                exception = ex;
+                status = "Cancelled";
+            }
+            catch (TimeoutException ex)
+            {
+                exception = ex;
+                status = "Timeout";
+            }
+            catch (Exception ex)
+            {
+                exception = ex;
+                status = ex.Message;
+            }
+            DownloadResult result = new DownloadResult();
+            result.PortName = engine.PortName;
+            result.Status = status;
+            result.Elapsed = elapsed.Elapsed;
+            result.Exception = exception;
+            return result;
+        }
+    }
+}
@@ -1,51 +1,71 @@
 ﻿using System;
-using System.Collections;
+using System.Collections.Generic;
 using System.IO;
-using System.Text.RegularExpressions;
 
 namespace IntelHex
 {
     class HexData
     {
-        public Hashtable Memory;
+        /// <summary>
+        ///  Bytes per page of the sparse image.  Pages are allocated the first time an
+        ///  address inside them is written, so a PIC16 image with a config word at 0x1000E
+        ///  costs three pages rather than a 64K array.
+        /// </summary>
+        public const int PageSize = 0x1000;
+
+        private class Page
+        {
+            public readonly byte[] Data = new byte[PageSize];
+            public readonly UInt64[] Present = new UInt64[PageSize / 64];
+            public int Count;
+        }
+
+        private readonly Dictionary<UInt32, Page> Pages = new Dictionary<UInt32, Page>();
         private String Warnings = "";
 
+        private int count = 0;
+        private UInt32 lowestAddress = 0;
+        private UInt32 highestAddress = 0;
+        private bool boundsValid = true;
+
         private const int HexLengthOffset = 1;
         private const int HexAddressOffset = 3;
         private const int HexRecordTypeOffset = 7;
         private const int HexDataOffset = 9;
 
-        private UInt32 HexToVal(string s)
+        /// <summary>
+        ///  Value of an ASCII hex digit, or -1 if the character is not a hex digit.
+        /// </summary>
+        private static int HexNibble(byte c)
         {
-            UInt32 returnvalue = 0;
-            s = s.ToUpper();
-            for (int i = 0; i < s.Length; ++i)
+            if ((c >= '0') && (c <= '9'))
             {
-                if ((s[i] >= '0') && (s[i] <= '9'))
-                {
-                    returnvalue *= 16;
-                    returnvalue += (UInt32)((byte)(s[i]) - (byte)'0');
-                }
-                else if ((s[i] >= 'A') && (s[i] <= 'F'))
-                {
-                    byte b = (byte)s[i];
-                    b -= (byte)'A';
-                    b += 10;
-                    returnvalue *= 16;
-                    returnvalue += b;
-                }
-                else
-                {
-                    throw new InvalidDataException("Invalid character " + s[i] + " in Hex conversion");
-                }
+                return c - '0';
+            }
+            c |= 0x20;  // Fold to lower case
+            if ((c >= 'a') && (c <= 'f'))
+            {
+                return c - 'a' + 10;
             }
-            return returnvalue;
+            return -1;
+        }
+
+        /// <summary>
+        ///  Decode the two hex digits at Offset.  Characters have already been validated.
+        /// </summary>
+        private static byte HexByte(ReadOnlySpan<byte> line, int Offset)
+        {
+            return (byte)((HexNibble(line[Offset]) << 4) | HexNibble(line[Offset + 1]));
+        }
+
+        private static bool IsWhiteSpace(byte c)
+        {
+            return c == ' ' || (c >= '\t' && c <= '\r');
         }
 
 
         public HexData()
         {
-            Memory = new Hashtable();
         }
 
         public HexData(string filename, Boolean enforceChecksum) : this()
@@ -53,137 +73,327 @@ namespace IntelHex
             Load(filename, enforceChecksum);
         }
 
-        public void Load(string Filename, Boolean EnforceChecksum)
+        /// <summary>
+        ///  Number of defined bytes in the image.
+        /// </summary>
+        public int Count
         {
-            using (StreamReader sr = new StreamReader(Filename))
+            get { return count; }
+        }
+
+        /// <summary>
+        ///  Returns true if the byte at Address has been defined by the hex file, Fill or an assignment.
+        /// </summary>
+        public bool Contains(UInt32 Address)
+        {
+            Page p;
+            if (!Pages.TryGetValue(Address / PageSize, out p))
             {
-                String line;
+                return false;
+            }
+            int offset = (int)(Address % PageSize);
+            return (p.Present[offset >> 6] & (1UL << (offset & 63))) != 0;
+        }
 
-                UInt32 extendedaddress = 0;
-                // Read and display lines from the file until the end of 
-                // the file is reached.
-                while ((line = sr.ReadLine()) != null)
+        /// <summary>
+        ///  Returns true if any byte from Start to Start + Length - 1 is defined.
+        /// </summary>
+        public bool ContainsAny(UInt32 Start, UInt32 Length)
+        {
+            UInt32 address = Start;
+            UInt32 end = Start + Length;
+            while (address < end)
+            {
+                UInt32 pageEnd = Math.Min((address / PageSize + 1) * PageSize, end);
+                Page p;
+                if (Pages.TryGetValue(address / PageSize, out p))
                 {
-                    //First remove any whitespace
-                    line = Regex.Replace(line, "\\s*", "");
-
-                    //Ignore lines that contain illegal characters
-                    if (Regex.Match(line, "[^A-Fa-f0-9:]").Success)
+                    for (; address < pageEnd; ++address)
                     {
-                        continue;
+                        int offset = (int)(address % PageSize);
+                        if ((p.Present[offset >> 6] & (1UL << (offset & 63))) != 0)
+                        {
+                            return true;
+                        }
                     }
-                    //The following prevents out of range exceptions later
-                    if (line.Length < 11)
+                }
+                address = pageEnd;
+            }
+            return false;
+        }
+
+        /// <summary>
+        ///  Get or set a single byte.  Reading an undefined address throws KeyNotFoundException.
+        /// </summary>
+        public byte this[UInt32 Address]
+        {
+            get
+            {
+                Page p;
+                if (Pages.TryGetValue(Address / PageSize, out p))
+                {
+                    int offset = (int)(Address % PageSize);
+                    if ((p.Present[offset >> 6] & (1UL << (offset & 63))) != 0)
                     {
-                        continue;
+                        return p.Data[offset];
                     }
+                }
+                throw new KeyNotFoundException(string.Format("Address 0x{0:X} is not defined", Address));
+            }
+            set
+            {
+                Set(Address, value);
+            }
+        }
+
+        /// <summary>
+        ///  Store a byte.  Returns false if the address was already defined (the value is still replaced).
+        /// </summary>
+        private bool Set(UInt32 Address, byte Value)
+        {
+            UInt32 pageNumber = Address / PageSize;
+            Page p;
+            if (!Pages.TryGetValue(pageNumber, out p))
+            {
+                p = new Page();
+                Pages[pageNumber] = p;
+            }
+            int offset = (int)(Address % PageSize);
+            p.Data[offset] = Value;
+            UInt64 mask = 1UL << (offset & 63);
+            if ((p.Present[offset >> 6] & mask) != 0)
+            {
+                return false;
+            }
+            p.Present[offset >> 6] |= mask;
+            ++p.Count;
+            if (count == 0)
+            {
+                lowestAddress = Address;
+                highestAddress = Address;
+                boundsValid = true;
+            }
+            else if (boundsValid)
+            {
+                if (Address < lowestAddress)
+                {
+                    lowestAddress = Address;
+                }
+                if (Address > highestAddress)
+                {
+                    highestAddress = Address;
+                }
+            }
+            ++count;
+            return true;
+        }
 
-                    // First character should be a ':'
-                    if (line[0] != ':')
+        public void Load(string Filename, Boolean EnforceChecksum)
+        {
+            Load(new ReadOnlySpan<byte>(File.ReadAllBytes(Filename)), EnforceChecksum);
+        }
+
+        /// <summary>
+        ///  Parse an Intel HEX image held in memory.  The text is scanned once.  Each line is
+        ///  compacted (whitespace removed) into a reused scratch buffer, checked for illegal
+        ///  characters and decoded in place while the checksum is accumulated, so no
+        ///  allocation is made per line or per byte.
+        /// </summary>
+        public void Load(ReadOnlySpan<byte> Text, Boolean EnforceChecksum)
+        {
+            // Longest legal record: ':' + 255 data bytes + 5 header/checksum bytes, 2 chars each
+            byte[] scratch = new byte[1 + 2 * (255 + 5)];
+            UInt32 extendedaddress = 0;
+
+            // Skip a UTF-8 byte order mark, as StreamReader did
+            if (Text.Length >= 3 && Text[0] == 0xEF && Text[1] == 0xBB && Text[2] == 0xBF)
+            {
+                Text = Text.Slice(3);
+            }
+
+            while (Text.Length > 0)
+            {
+                // Records end with LF, CR LF or a lone CR.  The empty record between CR and LF is skipped.
+                int end = Text.IndexOfAny((byte)'\r', (byte)'\n');
+                ReadOnlySpan<byte> raw = (end < 0) ? Text : Text.Slice(0, end);
+                Text = (end < 0) ? ReadOnlySpan<byte>.Empty : Text.Slice(end + 1);
+                if (raw.IsEmpty)
+                {
+                    continue;
+                }
+
+                //First remove any whitespace, and ignore lines that contain illegal characters
+                // or are too long to be a valid record
+                int length = 0;
+                bool illegal = false;
+                foreach (byte c in raw)
+                {
+                    if (IsWhiteSpace(c))
                     {
                         continue;
                     }
-
-                    // Get the length.  There are 11 bytes per line in addition to
-                    // the data.  Each byte of data takes 2 ascii characters to 
-                    // display.  Check that the indicated length matches the 
-                    // true length
-                    UInt32 length = HexToVal(line.Substring(HexLengthOffset, 2));
-                    if ((length * 2 + 11) != line.Length)
+                    if ((c != ':' && HexNibble(c) < 0) || length == scratch.Length)
                     {
-                        continue;
+                        illegal = true;
+                        break;
                     }
-                    UInt32 lineaddress = HexToVal(line.Substring(HexAddressOffset, 4));
+                    scratch[length++] = c;
+                }
+                if (illegal)
+                {
+                    continue;
+                }
+                ReadOnlySpan<byte> line = new ReadOnlySpan<byte>(scratch, 0, length);
+
+                //The following prevents out of range exceptions later
+                if (line.Length < 11)
+                {
+                    continue;
+                }
 
-                    UInt32 indicatedchecksum = HexToVal(line.Substring(line.Length - 2, 2));
-                    UInt32 calculatedchecksum = 0;
+                // First character should be a ':', and it may not appear anywhere else
+                if (line[0] != ':' || line.Slice(1).IndexOf((byte)':') >= 0)
+                {
+                    continue;
+                }
 
-                    for (int i = HexLengthOffset; i < line.Length - 3; i += 2)
-                    {
-                        calculatedchecksum += HexToVal(line.Substring(i, 2));
-                    }
-                    calculatedchecksum %= 256;
-                    calculatedchecksum = (256 - calculatedchecksum) % 256;
+                // Get the length.  There are 11 bytes per line in addition to
+                // the data.  Each byte of data takes 2 ascii characters to 
+                // display.  Check that the indicated length matches the 
+                // true length
+                int datalength = HexByte(line, HexLengthOffset);
+                if ((datalength * 2 + 11) != line.Length)
+                {
+                    continue;
+                }
 
-                    if ((calculatedchecksum != indicatedchecksum) && EnforceChecksum)
-                    {
-                        continue;
-                    }
+                // Every byte of the record, including the checksum, sums to zero mod 256
+                byte checksum = 0;
+                for (int i = HexLengthOffset; i < line.Length; i += 2)
+                {
+                    checksum += HexByte(line, i);
+                }
 
-                    // At this point, the line has been validated for length, leading
-                    // character, and checksum.
-                    // Switch based on command character
+                if ((checksum != 0) && EnforceChecksum)
+                {
+                    continue;
+                }
 
-                    UInt32 recordtype = HexToVal(line.Substring(HexRecordTypeOffset, 2));
+                // At this point, the line has been validated for length, leading
+                // character, and checksum.
+                // Switch based on command character
 
-                    switch (recordtype)
-                    {
-                        case 0:
-                            // Data Record
+                UInt32 lineaddress = (UInt32)((HexByte(line, HexAddressOffset) << 8) | HexByte(line, HexAddressOffset + 2));
+                byte recordtype = HexByte(line, HexRecordTypeOffset);
 
-                            for (UInt32 i = 0; i < length; ++i)
+                switch (recordtype)
+                {
+                    case 0:
+                        // Data Record
+
+                        for (int i = 0; i < datalength; ++i)
+                        {
+                            byte data = HexByte(line, HexDataOffset + 2 * i);
+                            UInt32 byteaddress = extendedaddress * 65536 + lineaddress + (UInt32)i;
+                            if (!Set(byteaddress, data))
                             {
-                                byte data = (byte)HexToVal(line.Substring((int)(HexDataOffset + 2 * i), 2));
-                                UInt32 byteaddress = extendedaddress * 65536 + lineaddress + i;
-                                if (Memory.ContainsKey((UInt32)(byteaddress)))
-                                {
-                                    Warnings += "Address " + String.Format("{0:X}", byteaddress) +
-                                        "is defined multiple times";
-                                }
-                                Memory[byteaddress] = data;
+                                Warnings += "Address " + String.Format("{0:X}", byteaddress) +
+                                    "is defined multiple times";
                             }
+                        }
 
-                            break;
+                        break;
 
-                        case 4:
-                            //Extended Record
+                    case 4:
+                        //Extended Record
 
-                            if (length != 2)
-                            {
-                                continue;
-                            }
-                            extendedaddress = HexToVal(line.Substring(HexDataOffset, 4));
+                        if (datalength != 2)
+                        {
+                            continue;
+                        }
+                        extendedaddress = (UInt32)((HexByte(line, HexDataOffset) << 8) | HexByte(line, HexDataOffset + 2));
 
-                            break;
+                        break;
 
-                        case 1:
-                            // End of File
+                    case 1:
+                        // End of File
 
-                            break;
+                        break;
 
-                        default:
-                            //unsupported line type
+                    default:
+                        //unsupported line type
 
-                            break;
-                    }
+                        break;
                 }
             }
         }
 
         public string TwoColumn()
         {
-            string s = "";
-            ArrayList keys = SortedKeys();
-            foreach (UInt32 key in keys)
+            System.Text.StringBuilder s = new System.Text.StringBuilder();
+            foreach (UInt32 pageNumber in SortedPageNumbers())
             {
-                s += string.Format("{0:X}", key) + " " + string.Format("{0,2:X}", Memory[key]) + "\n";
+                Page p = Pages[pageNumber];
+                for (int offset = 0; offset < PageSize; ++offset)
+                {
+                    if ((p.Present[offset >> 6] & (1UL << (offset & 63))) != 0)
+                    {
+                        s.AppendFormat("{0:X} {1,2:X}\n", pageNumber * PageSize + (UInt32)offset, p.Data[offset]);
+                    }
+                }
             }
-            return s;
+            return s.ToString();
         }
 
-        private ArrayList SortedKeys()
+        private List<UInt32> SortedPageNumbers()
         {
-            ArrayList aKeys = new ArrayList(Memory.Keys);
-            aKeys.Sort();
-            return aKeys;
+            List<UInt32> pageNumbers = new List<UInt32>(Pages.Keys);
+            pageNumbers.Sort();
+            return pageNumbers;
+        }
+
+        /// <summary>
+        ///  Recompute the cached bounds after bytes have been removed.  Only the first and
+        ///  last populated pages are scanned.
+        /// </summary>
+        private void UpdateBounds()
+        {
+            if (boundsValid || count == 0)
+            {
+                return;
+            }
+            List<UInt32> pageNumbers = SortedPageNumbers();
+            Page first = Pages[pageNumbers[0]];
+            for (int offset = 0; offset < PageSize; ++offset)
+            {
+                if ((first.Present[offset >> 6] & (1UL << (offset & 63))) != 0)
+                {
+                    lowestAddress = pageNumbers[0] * PageSize + (UInt32)offset;
+                    break;
+                }
+            }
+            Page last = Pages[pageNumbers[pageNumbers.Count - 1]];
+            for (int offset = PageSize - 1; offset >= 0; --offset)
+            {
+                if ((last.Present[offset >> 6] & (1UL << (offset & 63))) != 0)
+                {
+                    highestAddress = pageNumbers[pageNumbers.Count - 1] * PageSize + (UInt32)offset;
+                    break;
+                }
+            }
+            boundsValid = true;
         }
 
         public UInt32 HighestAddress
         {
             get
             {
-                ArrayList aKeys = SortedKeys();
-                return ((UInt32)aKeys[aKeys.Count - 1]);
+                if (count == 0)
+                {
+                    throw new InvalidOperationException("Hex image is empty");
+                }
+                UpdateBounds();
+                return highestAddress;
             }
         }
 
@@ -191,20 +401,43 @@ namespace IntelHex
         {
             get
             {
-                ArrayList aKeys = SortedKeys();
-                return ((UInt32)aKeys[0]);
+                if (count == 0)
+                {
+                    throw new InvalidOperationException("Hex image is empty");
+                }
+                UpdateBounds();
+                return lowestAddress;
             }
         }
 
         public void Crop(UInt32 InclusiveStartAddress, UInt32 ExclusiveEndAddress)
         {
-            ArrayList keys = SortedKeys();
-
-            foreach (UInt32 key in keys)
+            foreach (UInt32 pageNumber in SortedPageNumbers())
             {
-                if (key < InclusiveStartAddress || key >= ExclusiveEndAddress)
+                Page p = Pages[pageNumber];
+                UInt64 pageStart = (UInt64)pageNumber * PageSize;
+                if (pageStart >= InclusiveStartAddress && pageStart + PageSize <= ExclusiveEndAddress)
+                {
+                    continue;   // Entirely inside the kept range
+                }
+                for (int offset = 0; offset < PageSize; ++offset)
                 {
-                    Memory.Remove(key);
+                    UInt64 address = pageStart + (UInt64)offset;
+                    if (address < InclusiveStartAddress || address >= ExclusiveEndAddress)
+                    {
+                        UInt64 mask = 1UL << (offset & 63);
+                        if ((p.Present[offset >> 6] & mask) != 0)
+                        {
+                            p.Present[offset >> 6] &= ~mask;
+                            --p.Count;
+                            --count;
+                            boundsValid = false;
+                        }
+                    }
+                }
+                if (p.Count == 0)
+                {
+                    Pages.Remove(pageNumber);
                 }
             }
         }
@@ -213,9 +446,9 @@ namespace IntelHex
         {
             for (UInt32 address = InclusiveStartAddress; address < ExclusiveEndAddress; ++address)
             {
-                if (!Memory.ContainsKey(address))
+                if (!Contains(address))
                 {
-                    Memory[address] = value;
+                    Set(address, value);
                 }
             }
         }
@@ -224,54 +457,118 @@ namespace IntelHex
         {
             for (UInt32 address = InclusiveStartAddress; address < ExclusiveEndAddress; address += 2)
             {
-                if (!Memory.ContainsKey(address))
+                if (!Contains(address))
                 {
-                    Memory[address] = (byte)(value & 0xFF);
-                    Memory[address + 1] = (byte)(value >> 8);
+                    Set(address, (byte)(value & 0xFF));
+                    Set(address + 1, (byte)(value >> 8));
                 }
             }
         }
 
         public void Binary(string Filename, UInt32 InclusiveStartAddress, UInt32 ExclusiveEndAddress, byte value)
         {
-            FileStream fs = new FileStream(Filename, FileMode.Create);
+            byte[] buffer = new byte[ExclusiveEndAddress - InclusiveStartAddress];
+            CopyTo(InclusiveStartAddress, buffer, value);
+            File.WriteAllBytes(Filename, buffer);
+        }
+
+        public void Add(ref HexData x)
+        {
+            foreach (UInt32 pageNumber in x.SortedPageNumbers())
             {
-                for (UInt32 i = InclusiveStartAddress; i < ExclusiveEndAddress; ++i)
+                Page p = x.Pages[pageNumber];
+                for (int offset = 0; offset < PageSize; ++offset)
                 {
-                    if (Memory.ContainsKey(i))
+                    if ((p.Present[offset >> 6] & (1UL << (offset & 63))) != 0)
                     {
-                        fs.WriteByte((byte)Memory[i]);
+                        UInt32 key = pageNumber * PageSize + (UInt32)offset;
+                        if (Contains(key))
+                        {
+                            Warnings += (string.Format("Warning, address 0x{0:X} is being overwritten in add.  Original value: 0x{1:X} New Value: 0x{2:X}", key, this[key], p.Data[offset]));
+                        }
+                        Set(key, p.Data[offset]);
                     }
-                    else
+                }
+            }
+        }
+
+        /// <summary>
+        ///  Copy Destination.Length bytes starting at Start.  Undefined bytes are
+        ///  written as EmptyValue.
+        /// </summary>
+        public void CopyTo(UInt32 Start, Span<byte> Destination, byte EmptyValue)
+        {
+            int done = 0;
+            while (done < Destination.Length)
+            {
+                UInt32 address = Start + (UInt32)done;
+                int offset = (int)(address % PageSize);
+                int chunk = Math.Min(PageSize - offset, Destination.Length - done);
+                Page p;
+                if (Pages.TryGetValue(address / PageSize, out p))
+                {
+                    for (int i = 0; i < chunk; ++i)
                     {
-                        fs.WriteByte(value);
+                        int o = offset + i;
+                        Destination[done + i] = ((p.Present[o >> 6] & (1UL << (o & 63))) != 0) ? p.Data[o] : EmptyValue;
                     }
                 }
+                else
+                {
+                    Destination.Slice(done, chunk).Fill(EmptyValue);
+                }
+                done += chunk;
             }
-            fs.Close();
+        }
 
+        /// <summary>
+        ///  Copy Destination.Length bytes starting at Start.  Every byte must be defined.
+        /// </summary>
+        public void CopyTo(UInt32 Start, Span<byte> Destination)
+        {
+            int done = 0;
+            while (done < Destination.Length)
+            {
+                UInt32 address = Start + (UInt32)done;
+                int offset = (int)(address % PageSize);
+                int chunk = Math.Min(PageSize - offset, Destination.Length - done);
+                Page p;
+                if (!Pages.TryGetValue(address / PageSize, out p) || !AllPresent(p, offset, chunk))
+                {
+                    // Let the indexer report the first missing address
+                    for (int i = 0; i < chunk; ++i)
+                    {
+                        Destination[done + i] = this[address + (UInt32)i];
+                    }
+                }
+                else
+                {
+                    new ReadOnlySpan<byte>(p.Data, offset, chunk).CopyTo(Destination.Slice(done));
+                }
+                done += chunk;
+            }
         }
 
-        public void Add(ref HexData x)
+        private static bool AllPresent(Page p, int Offset, int Length)
         {
-            ArrayList aKeys = new ArrayList(x.Memory.Keys);
-            foreach (UInt32 key in aKeys)
+            if (p.Count == PageSize)
             {
-                if (Memory.ContainsKey(key))
+                return true;
+            }
+            for (int o = Offset; o < Offset + Length; ++o)
+            {
+                if ((p.Present[o >> 6] & (1UL << (o & 63))) == 0)
                 {
-                    Warnings += (string.Format("Warning, address 0x{0,X} is being overwritten in add.  Original value: 0x{1,X} New Value: 0x{2,X}", key, Memory[key], x.Memory[key]));
+                    return false;
                 }
-                Memory[key] = x.Memory[key];
             }
+            return true;
         }
 
         public byte[] Subarray(uint start, uint length)
         {
             byte[] b = new byte[length];
-            for (int i = 0; i < length; ++i)
-            {
-                b[i] = (byte)Memory[(UInt32)(i + start)];
-            }
+            CopyTo(start, b);
             return (b);
         }
     }
@@ -16,6 +16,8 @@ namespace WombatPanelWindowsForms
             InitializeComponent();
         }
         public string SelectedPort = null;
+        /// Every port selected, for gang programming.  SelectedPort is the first of them.
+        public string[] SelectedPorts = null;
         private void SerialPortSelector_Load(object sender, EventArgs e)
         {
             listBox1.Items.AddRange(SerialPort.GetPortNames());
@@ -25,7 +27,7 @@ namespace WombatPanelWindowsForms
         {
             if (listBox1.SelectedIndex != -1)
             {
-                SelectedPort = (string)listBox1.SelectedItem;
+                SelectPorts();
                 this.Close();
             }
 
@@ -35,14 +37,22 @@ namespace WombatPanelWindowsForms
         private void button2_Click(object sender, EventArgs e)
         {
             SelectedPort = null;
+            SelectedPorts = null;
             this.Close();
         }
 
+        private void SelectPorts()
+        {
+            SelectedPorts = new string[listBox1.SelectedItems.Count];
+            listBox1.SelectedItems.CopyTo(SelectedPorts, 0);
+            SelectedPort = SelectedPorts[0];
+        }
+
         private void listBox1_DoubleClick(object sender, EventArgs e)
         {
             if (listBox1.SelectedIndex != -1)
             {
-                SelectedPort = (string)listBox1.SelectedItem;
+                SelectPorts();
                 this.Close();
             }
 
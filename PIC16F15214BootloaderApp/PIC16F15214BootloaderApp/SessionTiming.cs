@@ -0,0 +1,89 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.Text;
+
+namespace PIC16F15214BootloaderApp
+{
+    /// <summary>
+    ///  Per-session timing report: how long each host step took, plus the bootloader's own figures from 'T'.
+    /// </summary>
+    class SessionTiming
+    {
+        /// Bootloader Timer 1 rate (LFINTOSC)
+        const double TicksPerSecond = 31000.0;
+        static readonly string[] PhaseNames = { "Erase", "Write", "Readback", "Host paused" };
+
+        readonly Stopwatch _total = Stopwatch.StartNew();
+        readonly List<KeyValuePair<string, TimeSpan>> _steps = new List<KeyValuePair<string, TimeSpan>>();
+        TimeSpan _lastMark = TimeSpan.Zero;
+        byte[] _device = null;
+
+        /// <summary>
+        ///  Record the time since the previous mark (or the start) against a host step.
+        /// </summary>
+        public void Mark(string step)
+        {
+            TimeSpan now = _total.Elapsed;
+            _steps.Add(new KeyValuePair<string, TimeSpan>(step, now - _lastMark));
+            _lastMark = now;
+        }
+
+        /// <summary>
+        ///  Keep the bytes that follow 'T' and the count.
+        /// </summary>
+        public void SetDeviceFigures(byte[] reply)
+        {
+            _device = reply;
+        }
+
+        public TimeSpan Total
+        {
+            get { return _total.Elapsed; }
+        }
+
+        /// <summary>
+        ///  The host steps marked so far, in order.
+        /// </summary>
+        public IReadOnlyList<KeyValuePair<string, TimeSpan>> Steps
+        {
+            get { return _steps; }
+        }
+
+        static double Milliseconds(byte[] reply, int offset)
+        {
+            return (reply[offset] | (reply[offset + 1] << 8)) * 1000.0 / TicksPerSecond;
+        }
+
+        public override string ToString()
+        {
+            StringBuilder report = new StringBuilder();
+            report.AppendLine("Host:");
+            foreach (KeyValuePair<string, TimeSpan> step in _steps)
+            {
+                report.AppendLine($"  {step.Key,-14}{step.Value.TotalMilliseconds,9:F1} ms");
+            }
+            report.AppendLine($"  {"Total",-14}{Total.TotalMilliseconds,9:F1} ms");
+
+            if (_device != null && _device.Length >= 2 + PhaseNames.Length * 6)
+            {
+                report.AppendLine("Bootloader:");
+                if (_device[0] == 0xFF && _device[1] == 0xFF)
+                {
+                    report.AppendLine($"  {"Handshake",-14}  > 2 s");
+                }
+                else
+                {
+                    report.AppendLine($"  {"Handshake",-14}{Milliseconds(_device, 0),9:F1} ms after banner");
+                }
+                for (int i = 0; i < PhaseNames.Length; ++i)
+                {
+                    int offset = 2 + i * 6;
+                    int count = _device[offset] | (_device[offset + 1] << 8);
+                    report.AppendLine($"  {PhaseNames[i],-14}{Milliseconds(_device, offset + 2),9:F1} ms in {count} intervals, longest {Milliseconds(_device, offset + 4):F2} ms");
+                }
+            }
+            return report.ToString();
+        }
+    }
+}
@@ -0,0 +1,761 @@
+﻿using System;
+
+namespace PIC16F15214Emulator
+{
+    /// <summary>
+    ///  Model of the bootloader in BootloaderPIC16F15214.X/main.c.  Each method follows the firmware function of the same
+    ///  name, so the host sees the same bytes in the same order, including the XOFF/XON pacing and NAK recovery of
+    ///  the 'S' command.  Flash is 4K words of 14 bits.  Programming can only clear bits, as on the part, so a row
+    ///  written without an erase shows up as a verify failure rather than being hidden by the model.
+    ///  A pty has no line rate, so a framing error is modelled as a byte that arrives while the host's port is set to
+    ///  a different rate from the model's.  Not modelled: receiver overruns (a pty never loses a byte), Vdd (the 'B'
+    ///  command always succeeds) and Warm_Entry.
+    /// </summary>
+    class BootloaderModel
+    {
+        const int WriteFlashBlocksize = 32;
+        const int EraseFlashBlocksize = 32;
+        public const int EndFlash = 0x1000;
+        /// Where the 0xF6 session's host starts sending the application area, whatever NewResetVector is
+        const int LegacyResetVector = 0x140;
+        const int AppCrcAddress = 0xFFC;
+        const byte Xon = 0x11;
+        const byte Xoff = 0x13;
+        const byte BootloaderVersion = 1;
+        /// Configuration words the model reports as REVISIONID and DEVICEID (PIC16F15214)
+        const ushort RevisionId = 0x2002;
+        const ushort DeviceId = 0x30E4;
+
+        const int PhaseErase = 0;
+        const int PhaseWrite = 1;
+        const int PhaseReadback = 2;
+        const int PhaseStall = 3;
+        const int Phases = 4;
+
+        const byte WriteReserved = 0x01;
+        const byte WriteAddressed = 0x02;
+        const byte WriteSkipUnchanged = 0x04;
+        const byte WriteAckCrc = 0x08;
+        const byte WriteChecksum = 0x10;
+        const byte WriteRunLength = 0x20;
+
+        /// Timer 1 rate (LFINTOSC)
+        const double TicksPerSecond = 31000.0;
+        /// Row erase and row write stalls.  Erasing the whole application area takes about 300mS on the part.
+        const double RowEraseSeconds = 0.0025;
+        const double RowWriteSeconds = 0.0025;
+        /// Crc_Flash's cost per word: about 80 instruction cycles at 4 MIPS
+        const double CrcWordSeconds = 80 / 4e6;
+        /// Image_Sum's cost per word: about 18 instruction cycles at 4 MIPS
+        const double SumWordSeconds = 18 / 4e6;
+        /// How long Stream_Nak waits for the line to go quiet
+        const int NakQuietMs = 5;
+        /// How long Set_Baud waits for the host's 'B' at the new rate
+        const int BaudConfirmMs = 600;
+        /// How long Read_Or_Handshake waits for each byte after 'R' (HANDSHAKE_POLLS, 5 to 10mS on the part)
+        const int HandshakeGapMs = 5;
+        /// Rates selected by the 'B' command's codes
+        static readonly int[] BaudRates = { 115200, 230400, 460800, 1000000 };
+
+        readonly PtyPort _port;
+        readonly Action<string> _log;
+        readonly ushort[] _flash = new ushort[EndFlash];
+
+        // Build options of the modelled bootloader
+        readonly bool _extended;
+        readonly bool _appCrcCheck;
+        readonly int _autobootWindowMs;
+        /// Stay in boot at every reset, as if the application had overflowed the stack on purpose
+        readonly bool _stayInBoot;
+        /// Rows 'S' may still write before the power fails, or 0 for never
+        int _powerFailRows = 0;
+
+        byte _bootloadReason;
+        readonly byte[] _startBytes = new byte[4];
+        readonly byte[] _rowBuffer = new byte[WriteFlashBlocksize * 2];
+        ushort _crc;
+
+        double _timer1Start;
+        ushort _handshakeTicks;
+        readonly ushort[] _phaseTotal = new ushort[Phases];
+        readonly ushort[] _phaseMax = new ushort[Phases];
+        readonly ushort[] _phaseCount = new ushort[Phases];
+        ushort _pauseStart;
+
+        public BootloaderModel(PtyPort port, bool extended, bool appCrcCheck, int autobootWindowMs, bool stayInBoot,
+            Action<string> log)
+        {
+            _port = port;
+            _extended = extended || appCrcCheck;
+            _appCrcCheck = appCrcCheck;
+            _autobootWindowMs = autobootWindowMs;
+            _stayInBoot = stayInBoot;
+            _log = log;
+            Array.Fill(_flash, (ushort)0x3FFF);
+        }
+
+        /// Word address of the application's reset vector (NEW_RESET_VECTOR)
+        public int NewResetVector
+        {
+            get { return _extended ? 0x400 : 0x140; }
+        }
+
+        /// <summary>
+        ///  Lose power once, straight after the 'S' command has written this many rows, as if the board were unplugged
+        ///  part way through a download.
+        /// </summary>
+        public void PowerFailAfterRows(int rows)
+        {
+            _powerFailRows = rows;
+        }
+
+        /// <summary>
+        ///  Program a word into the application area before the first reset, as if an earlier download had.
+        /// </summary>
+        public void Preload(int address, ushort word)
+        {
+            if (address >= NewResetVector && address < EndFlash)
+            {
+                _flash[address] = (ushort)(word & 0x3FFF);
+            }
+        }
+
+        /// <summary>
+        ///  Run from reset until the next reset, which PtyPort signals with TargetResetException.  As main(): stay in boot if
+        ///  Bootload_Required or the listen window says so, otherwise run the application, which ignores the port.
+        /// </summary>
+        public void PowerOn()
+        {
+            _port.Reset();
+            Array.Clear(_startBytes, 0, _startBytes.Length);  // Cleared by the startup code
+            _bootloadReason = Bootload_Required();
+            if (_bootloadReason == 0 && _autobootWindowMs != 0)
+            {
+                _bootloadReason = Listen_Window();
+            }
+            if (_bootloadReason != 0)
+            {
+                _log($"Reset, staying in boot ('{(char)_bootloadReason}')");
+                Run_Bootloader();
+            }
+            else
+            {
+                _log("Reset, running the application");
+            }
+            while (true)
+            {
+                _port.Read();  // Until a DTR reset
+            }
+        }
+
+        byte Bootload_Required()
+        {
+            ushort last = Read_Word(0xFFF);
+            if ((last & 0xFF) != 0xB7)
+            {
+                return (byte)'L';
+            }
+            if ((last >> 8) != 0x14)
+            {
+                return (byte)'H';
+            }
+            if (Read_Word(NewResetVector) == 0x3FFF)
+            {
+                return (byte)'F';
+            }
+            if (_stayInBoot)
+            {
+                return (byte)'S';
+            }
+            if (_appCrcCheck)
+            {
+                int end = Read_Word(AppCrcAddress);
+                ushort stored = (ushort)((Read_Word(AppCrcAddress + 1) & 0xFF) | ((Read_Word(AppCrcAddress + 2) & 0xFF) << 8));
+                if (end <= NewResetVector || end > AppCrcAddress)
+                {
+                    return (byte)'C';
+                }
+                if (Image_Sum(NewResetVector, end) != stored)
+                {
+                    return (byte)'C';
+                }
+            }
+            return 0;
+        }
+
+        /// <summary>
+        ///  The AUTOBOOT_WINDOW_MS listen window.  No one has the port open at power on, so the window waits for the
+        ///  host to open the port.  After a DTR reset it opens at once.  An 0xF6 or 0xF7
+        ///  handshake is left in _startBytes for Run_Bootloader to act on; 0xF5 only wakes the bootloader.
+        /// </summary>
+        byte Listen_Window()
+        {
+            _port.WaitForHost();
+            double end = _port.Now + _autobootWindowMs / 1000.0;
+            while (_port.Now < end)
+            {
+                int b = _port.Read((int)Math.Ceiling((end - _port.Now) * 1000));
+                if (b < 0)
+                {
+                    break;
+                }
+                Shift_Start((byte)b);
+                if (_startBytes[0] == 0x52 && _startBytes[1] == 0xA3 && _startBytes[2] == 0x4D &&
+                    _startBytes[3] >= 0xF5 && _startBytes[3] <= 0xF7)
+                {
+                    if (_startBytes[3] == 0xF5)
+                    {
+                        _startBytes[3] = 0;
+                    }
+                    return (byte)'T';
+                }
+            }
+            return 0;
+        }
+
+        void Shift_Start(byte b)
+        {
+            _startBytes[0] = _startBytes[1];
+            _startBytes[1] = _startBytes[2];
+            _startBytes[2] = _startBytes[3];
+            _startBytes[3] = b;
+        }
+
+        void Run_Bootloader()
+        {
+            _port.Baud = BaudRates[0];
+            _port.Write("EBOOT");
+            _port.Write(_bootloadReason);
+            _port.Write(">>");
+            _timer1Start = _port.Now;
+
+            while (_startBytes[0] != 0x52 ||
+                _startBytes[1] != 0xA3 ||
+                _startBytes[2] != 0x4D ||
+                (_startBytes[3] != 0xF6 && !(_extended && _startBytes[3] == 0xF7)))
+            {
+                Shift_Start(_port.Read());
+            }
+            if (_startBytes[3] == 0xF7)
+            {
+                Command_Session();  // Does not return
+            }
+            _log("Download session");
+            _port.Write((byte)'e');
+
+            Erase_Flash();
+
+            _port.Write((byte)'W');
+
+            // Write_Flash: every word from LegacyResetVector, committed a row at a time.  Rows below the application
+            // area are acknowledged but never written.
+            for (int address = LegacyResetVector; address < EndFlash; ++address)
+            {
+                _rowBuffer[(address & 0x1F) * 2] = _port.Read();
+                _rowBuffer[(address & 0x1F) * 2 + 1] = _port.Read();
+                if ((address & 0x1F) == 0x1F)
+                {
+                    if (address >= NewResetVector)
+                    {
+                        Program_Row(address & ~0x1F);
+                    }
+                    _port.Write((byte)'W');
+                }
+            }
+
+            Read_Flash();
+            _log("Download complete, waiting for reset");
+        }
+
+        void Erase_Flash()
+        {
+            for (int address = NewResetVector; address < EndFlash; address += EraseFlashBlocksize)
+            {
+                Erase_Row(address);
+            }
+        }
+
+        /// The blank check is only built with EXTENDED_COMMANDS; the default build erases every row
+        void Erase_Row(int address)
+        {
+            if (_extended && Row_Blank(address))
+            {
+                return;
+            }
+            ushort start = Tmr1;
+            for (int i = 0; i < EraseFlashBlocksize; ++i)
+            {
+                _flash[address + i] = 0x3FFF;
+            }
+            _port.Delay(RowEraseSeconds);
+            if (_extended)
+            {
+                Phase_End(PhaseErase, start);
+            }
+        }
+
+        bool Row_Blank(int address)
+        {
+            for (int i = 0; i < WriteFlashBlocksize; ++i)
+            {
+                if (_flash[address + i] != 0x3FFF)
+                {
+                    return (false);
+                }
+            }
+            return (true);
+        }
+
+        /// The 0xF6 session's host gets the area back from LegacyResetVector, with the words below the application blank
+        void Read_Flash()
+        {
+            _port.Write((byte)'R');
+            if (_startBytes[3] == 0xF6)
+            {
+                for (int address = LegacyResetVector; address < NewResetVector; ++address)
+                {
+                    Send_Word(0x3FFF);
+                }
+            }
+            for (int address = NewResetVector; address < EndFlash; ++address)
+            {
+                _port.Write((byte)_flash[address]);
+                _port.Write((byte)(_flash[address] >> 8));
+            }
+        }
+
+        /// <summary>
+        ///  As on the part, the session lasts until reset.  A framing error puts the rate back to 115200, and a new
+        ///  host's handshake is told from 'R' and answered again.
+        /// </summary>
+        void Command_Session()
+        {
+            Session_Start();
+            while (true)
+            {
+                byte command = _port.Read();
+                if (Framing_Error())
+                {
+                    _log("Framing error, back to 115200");
+                    _port.Baud = BaudRates[0];
+                    continue;
+                }
+                if (command == 'R')
+                {
+                    command = Read_Or_Handshake();
+                }
+                _log($"Command '{(char)command}'");
+                switch ((char)command)
+                {
+                    case 'c':  // A new host's handshake
+                        Session_Start();
+                        break;
+
+                    case 'E':
+                        Erase_Flash();
+                        _port.Write((byte)'W');
+                        break;
+
+                    case 'S':
+                        Stream_Write();
+                        break;
+
+                    case 'R':
+                        Read_Flash();
+                        break;
+
+                    case 'C':
+                        Crc_Range();
+                        break;
+
+                    case 'H':
+                        Row_Hashes();
+                        break;
+
+                    case 'B':
+                        Set_Baud();
+                        break;
+
+                    case 'I':
+                        Device_Info();
+                        break;
+
+                    case 'T':
+                        Send_Timing();
+                        break;
+
+                    default:
+                        _port.Write((byte)'?');
+                        break;
+                }
+            }
+        }
+
+        void Session_Start()
+        {
+            double waited = (_port.Now - _timer1Start) * TicksPerSecond;
+            _handshakeTicks = (waited > 0xFFFF) ? (ushort)0xFFFF : (ushort)waited;
+            _port.Write((byte)'c');
+            Array.Clear(_phaseTotal, 0, Phases);
+            Array.Clear(_phaseMax, 0, Phases);
+            Array.Clear(_phaseCount, 0, Phases);
+            _port.Write((byte)NewResetVector);
+            _port.Write((byte)(NewResetVector >> 8));
+            _log("Command session");
+        }
+
+        /// <summary>
+        ///  'R' if nothing follows it, 'c' if the rest of a handshake does, '?' for anything else.
+        /// </summary>
+        byte Read_Or_Handshake()
+        {
+            _startBytes[3] = 0x52;
+            while (_startBytes[0] != 0x52 ||
+                _startBytes[1] != 0xA3 ||
+                _startBytes[2] != 0x4D ||
+                _startBytes[3] != 0xF7)
+            {
+                int b = _port.Read(HandshakeGapMs);
+                if (b < 0)
+                {
+                    return (_startBytes[3] == 0x52) ? (byte)'R' : (byte)'?';
+                }
+                Shift_Start((byte)b);
+            }
+            return (byte)'c';
+        }
+
+        /// <summary>
+        ///  The byte just read was sent at a rate other than the model's.
+        /// </summary>
+        bool Framing_Error()
+        {
+            int hostBaud = _port.HostBaud;
+            return (hostBaud != 0 && hostBaud != _port.Baud);
+        }
+
+        void Stream_Write()
+        {
+            byte seq = 0;
+            byte flags = _port.Read();
+            int row;
+            bool changed;
+            ushort packetCrc = 0;
+
+            if ((flags & (WriteReserved | WriteAddressed)) != WriteAddressed)
+            {
+                _port.Write((byte)'?');
+                return;
+            }
+            while (true)
+            {
+                if (_port.Read() != seq)
+                {
+                    Stream_Nak(seq);
+                    continue;
+                }
+
+                row = _port.Read();
+                row |= _port.Read() << 8;
+                if (row == 0xFFFF)  // End of stream
+                {
+                    if ((flags & WriteChecksum) != 0)
+                    {
+                        packetCrc = _port.Read();
+                        packetCrc |= (ushort)(_port.Read() << 8);
+                        if (Packet_Crc(seq, row, 0) != packetCrc)
+                        {
+                            Stream_Nak(seq);
+                            continue;
+                        }
+                    }
+                    _port.Write((byte)(0x80 | seq));
+                    _port.Write(Xon);
+                    return;
+                }
+                if ((row & 0x1F) != 0 || row < NewResetVector || row >= EndFlash)
+                {
+                    Stream_Nak(seq);  // Never write over the bootloader
+                    continue;
+                }
+
+                // Receive the row, comparing it with what is already programmed
+                changed = false;
+                for (int i = 0; i < WriteFlashBlocksize * 2; )
+                {
+                    byte low = _port.Read();
+                    byte high = _port.Read();
+                    byte count = 1;
+                    if ((flags & WriteRunLength) != 0 && (high & 0x80) != 0)
+                    {
+                        count = _port.Read();
+                        high &= 0x3F;
+                    }
+                    do
+                    {
+                        ushort programmed = _flash[row + i / 2];
+                        _rowBuffer[i] = low;
+                        _rowBuffer[i + 1] = high;
+                        changed |= low != (byte)programmed || ((high ^ (programmed >> 8)) & 0x3F) != 0;
+                        i += 2;
+                    } while (--count != 0 && i < WriteFlashBlocksize * 2);  // A count of 0 is 256
+                }
+                if ((flags & WriteChecksum) != 0)
+                {
+                    packetCrc = _port.Read();
+                    packetCrc |= (ushort)(_port.Read() << 8);
+                }
+
+                Pause_Host();
+                if ((flags & WriteChecksum) != 0 && Packet_Crc(seq, row, WriteFlashBlocksize * 2) != packetCrc)
+                {
+                    Stream_Nak(seq);  // Corrupted in transit.  Nothing has been erased or written.
+                    continue;
+                }
+                if ((flags & WriteSkipUnchanged) != 0)
+                {
+                    if (changed)
+                    {
+                        Erase_Row(row);
+                        Write_Row(row);
+                    }
+                }
+                else
+                {
+                    Write_Row(row);
+                }
+                if ((flags & WriteAckCrc) != 0)
+                {
+                    Crc_Flash(row, row + WriteFlashBlocksize);  // Read back what is now in flash
+                }
+
+                _port.Write((byte)(0x80 | seq));
+                if ((flags & WriteSkipUnchanged) != 0)
+                {
+                    _port.Write((byte)(changed ? 'W' : 'U'));
+                }
+                if ((flags & WriteAckCrc) != 0)
+                {
+                    _port.Write((byte)(0x40 | (_crc & 0x3F)));
+                    _port.Write((byte)(0x40 | ((_crc >> 6) & 0x3F)));
+                    _port.Write((byte)(0x40 | (_crc >> 12)));
+                }
+                seq = (byte)((seq + 1) & 0x7F);
+                Resume_Host(seq);
+            }
+        }
+
+        ushort Packet_Crc(byte seq, int row, int length)
+        {
+            _crc = 0xFFFF;
+            Crc16_Update(seq);
+            Crc16_Update((byte)row);
+            Crc16_Update((byte)(row >> 8));
+            for (int i = 0; i < length; ++i)
+            {
+                Crc16_Update(_rowBuffer[i]);
+            }
+            return _crc;
+        }
+
+        void Write_Row(int address)
+        {
+            ushort start = Tmr1;
+            Program_Row(address);
+            Phase_End(PhaseWrite, start);
+            if (_powerFailRows != 0 && --_powerFailRows == 0)
+            {
+                _log($"Power failed after writing row 0x{address:X3}");
+                throw new TargetResetException();
+            }
+        }
+
+        /// <summary>
+        ///  Commit _rowBuffer to the row at address.  A write can only clear bits.
+        /// </summary>
+        void Program_Row(int address)
+        {
+            for (int i = 0; i < WriteFlashBlocksize; ++i)
+            {
+                _flash[address + i] &= (ushort)((_rowBuffer[2 * i] | (_rowBuffer[2 * i + 1] << 8)) & 0x3FFF);
+            }
+            _port.Delay(RowWriteSeconds);
+        }
+
+        void Device_Info()
+        {
+            _port.Write((byte)'I');
+            _port.Write(12);  // Bytes that follow
+            _port.Write(BootloaderVersion);
+            _port.Write(_bootloadReason);
+            Send_Word(RevisionId);
+            Send_Word(DeviceId);
+            for (int i = 0; i < 3; ++i)
+            {
+                Send_Word(Read_Word(AppCrcAddress + i));
+            }
+        }
+
+        void Send_Word(ushort word)
+        {
+            _port.Write((byte)word);
+            _port.Write((byte)(word >> 8));
+        }
+
+        void Set_Baud()
+        {
+            byte code = _port.Read();
+            if (code > 3)
+            {
+                _port.Write((byte)'!');
+                return;
+            }
+            _port.Write((byte)'B');
+            _port.Baud = BaudRates[code];
+            if (_port.Read(BaudConfirmMs) == 'B' && !Framing_Error())
+            {
+                _port.Write((byte)'b');
+                _log($"Baud rate {BaudRates[code]}");
+                return;
+            }
+            _port.Baud = BaudRates[0];
+        }
+
+        void Crc_Range()
+        {
+            int start = _port.Read();
+            start |= _port.Read() << 8;
+            int end = _port.Read();
+            end |= _port.Read() << 8;
+            if (end > EndFlash || end < start)
+            {
+                _port.Write((byte)'?');
+                return;
+            }
+
+            Crc_Flash(start, end);
+            _port.Write((byte)'C');
+            _port.Write((byte)_crc);
+            _port.Write((byte)(_crc >> 8));
+        }
+
+        void Row_Hashes()
+        {
+            _port.Write((byte)'H');
+            for (int address = NewResetVector; address < EndFlash; address += WriteFlashBlocksize)
+            {
+                Crc_Flash(address, address + WriteFlashBlocksize);
+                _port.Write((byte)_crc);
+                _port.Write((byte)(_crc >> 8));
+            }
+        }
+
+        /// <summary>
+        ///  Set _crc to the CRC of flash from start up to (not including) end.  As on the part, NVMADR is 15 bits and
+        ///  wraps, and there is nothing to read above the end of flash.
+        /// </summary>
+        void Crc_Flash(int start, int end)
+        {
+            ushort timer = Tmr1;
+            int words = 0;
+
+            _crc = 0xFFFF;
+            for (int address = start & 0x7FFF; address != (end & 0x7FFF); address = (address + 1) & 0x7FFF)
+            {
+                ushort word = Read_Word(address);
+                Crc16_Update((byte)word);
+                Crc16_Update((byte)(word >> 8));
+                ++words;
+            }
+            _port.Delay(words * CrcWordSeconds);
+            Phase_End(PhaseReadback, timer);
+        }
+
+        /// <summary>
+        ///  Fletcher style sum of the words from start up to (not including) end, for the boot time image check.
+        /// </summary>
+        ushort Image_Sum(int start, int end)
+        {
+            ushort sumA = 0;
+            ushort sumB = 0;
+
+            for (int address = start; address != end; ++address)
+            {
+                sumA += Read_Word(address);
+                sumB += sumA;
+            }
+            _port.Delay((end - start) * SumWordSeconds);
+            return sumB;
+        }
+
+        void Crc16_Update(byte data)
+        {
+            _crc = (ushort)((_crc >> 8) | (_crc << 8));
+            _crc ^= data;
+            _crc ^= (ushort)((_crc & 0xFF) >> 4);
+            _crc ^= (ushort)(_crc << 12);
+            _crc ^= (ushort)((_crc & 0xFF) << 5);
+        }
+
+        void Pause_Host()
+        {
+            _port.Write(Xoff);
+            _port.Delay(0);  // Out of the shift register before the CPU stalls
+            _pauseStart = Tmr1;
+        }
+
+        void Resume_Host(byte seq)
+        {
+            Phase_End(PhaseStall, _pauseStart);
+            _port.Write(Xon);
+        }
+
+        void Phase_End(int phase, ushort start)
+        {
+            ushort ticks = (ushort)(Tmr1 - start);
+
+            _phaseTotal[phase] += ticks;
+            if (ticks > _phaseMax[phase])
+            {
+                _phaseMax[phase] = ticks;
+            }
+            ++_phaseCount[phase];
+        }
+
+        void Send_Timing()
+        {
+            _port.Write((byte)'T');
+            _port.Write(2 + Phases * 6);  // Bytes that follow
+            Send_Word(_handshakeTicks);
+            for (int i = 0; i < Phases; ++i)
+            {
+                Send_Word(_phaseCount[i]);
+                Send_Word(_phaseTotal[i]);
+                Send_Word(_phaseMax[i]);
+            }
+        }
+
+        void Stream_Nak(byte seq)
+        {
+            _log($"NAK row {seq}");
+            _port.Write((byte)'N');
+            _port.Write((byte)(0x80 | seq));
+            while (_port.Read(NakQuietMs) >= 0)
+            {
+            }
+            _port.Write(Xon);
+        }
+
+        /// Flash as NVMDAT reads it: 14 bits, nothing above the end of flash
+        ushort Read_Word(int address)
+        {
+            return (address < EndFlash) ? _flash[address] : (ushort)0;
+        }
+
+        /// Timer 1, free running on LFINTOSC since the banner
+        ushort Tmr1
+        {
+            get { return (ushort)(long)((_port.Now - _timer1Start) * TicksPerSecond); }
+        }
+    }
+}
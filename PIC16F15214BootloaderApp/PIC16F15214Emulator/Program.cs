@@ -0,0 +1,174 @@
+﻿using System;
+using System.IO;
+using System.Runtime.InteropServices;
+using IntelHex;
+
+namespace PIC16F15214Emulator
+{
+    /// <summary>
+    ///  Software model of a PIC16F15214 running the bootloader, behind a Linux pseudo-terminal, so the downloader
+    ///  can be exercised and timed without hardware.  Prints the port to open on stdout, then serves sessions until
+    ///  killed.  A DTR pulse from a host run with ptymodem.c resets the model; closing the port does not.
+    /// </summary>
+    static class Program
+    {
+        const string UsageText =
+@"Usage: PIC16F15214Emulator [options]
+
+  -e, --extended            Model a bootloader built with EXTENDED_COMMANDS.
+      --app-crc-check       Model APP_CRC_CHECK (implies --extended).
+  -w, --autoboot-window <ms>
+                            Model AUTOBOOT_WINDOW_MS.  The window opens at a reset
+                            or, after power on, when the host opens the port.
+  -f, --flash <file.hex>    Start with this application programmed.  Only the
+                            application area is loaded.
+  -s, --stay                Stay in boot at every reset (reason 'S').
+  -p, --power-fail <rows>   Lose power once, when the 'S' command has written this
+                            many rows.
+  -r, --realtime            Take as long as the part would: bytes at the baud rate,
+                            row erases and writes, CRC reads.
+  -l, --link <path>         Also make <path> a symbolic link to the port.
+  -v, --verbose             Log resets and commands to stderr.
+
+Prints the port to open, e.g. /dev/pts/3, on stdout.  As on a board, closing the
+port does not reset the model.  Hosts that set DTR or RTS, such as PIC16F15214Flash,
+need ptymodem.c to open a pty; with it, a DTR pulse (--reset) resets the model.";
+
+        [DllImport("libc", SetLastError = true)]
+        static extern int symlink(string target, string linkpath);
+
+        static int Main(string[] args)
+        {
+            bool extended = false;
+            bool appCrcCheck = false;
+            int autobootWindowMs = 0;
+            string image = null;
+            bool stay = false;
+            int powerFailRows = 0;
+            bool realtime = false;
+            string link = null;
+            bool verbose = false;
+
+            for (int i = 0; i < args.Length; ++i)
+            {
+                switch (args[i])
+                {
+                    case "-e":
+                    case "--extended":
+                        extended = true;
+                        break;
+                    case "--app-crc-check":
+                        appCrcCheck = true;
+                        break;
+                    case "-w":
+                    case "--autoboot-window":
+                        if (++i >= args.Length || !int.TryParse(args[i], out autobootWindowMs) || autobootWindowMs <= 0)
+                        {
+                            return UsageError("The autoboot window needs a time in milliseconds");
+                        }
+                        break;
+                    case "-f":
+                    case "--flash":
+                        image = (++i < args.Length) ? args[i] : null;
+                        break;
+                    case "-s":
+                    case "--stay":
+                        stay = true;
+                        break;
+                    case "-p":
+                    case "--power-fail":
+                        if (++i >= args.Length || !int.TryParse(args[i], out powerFailRows) || powerFailRows <= 0)
+                        {
+                            return UsageError("The power failure needs a number of rows");
+                        }
+                        break;
+                    case "-r":
+                    case "--realtime":
+                        realtime = true;
+                        break;
+                    case "-l":
+                    case "--link":
+                        link = (++i < args.Length) ? args[i] : null;
+                        break;
+                    case "-v":
+                    case "--verbose":
+                        verbose = true;
+                        break;
+                    case "-h":
+                    case "--help":
+                        Console.WriteLine(UsageText);
+                        return 0;
+                    default:
+                        return UsageError($"Unknown option '{args[i]}'");
+                }
+            }
+
+            using PtyPort port = new PtyPort();
+            port.Realtime = realtime;
+            Action<string> log = verbose ? (Action<string>)(message => Console.Error.WriteLine(message)) : message => { };
+            BootloaderModel model = new BootloaderModel(port, extended, appCrcCheck, autobootWindowMs, stay, log);
+            model.PowerFailAfterRows(powerFailRows);
+
+            if (image != null)
+            {
+                try
+                {
+                    Preload(model, new HexData(image, true));
+                }
+                catch (Exception ex)
+                {
+                    Console.Error.WriteLine($"{image}: {ex.Message}");
+                    return 3;
+                }
+            }
+            if (link != null)
+            {
+                File.Delete(link);
+                if (symlink(port.SlaveName, link) != 0)
+                {
+                    Console.Error.WriteLine($"Cannot link {link} to {port.SlaveName} (errno {Marshal.GetLastWin32Error()})");
+                    return 4;
+                }
+                AppDomain.CurrentDomain.ProcessExit += (sender, e) => File.Delete(link);
+                Console.CancelKeyPress += (sender, e) => File.Delete(link);
+            }
+            Console.WriteLine(port.SlaveName);
+
+            while (true)
+            {
+                try
+                {
+                    model.PowerOn();
+                }
+                catch (TargetResetException)
+                {
+                    // Power cycle
+                }
+            }
+        }
+
+        /// <summary>
+        ///  Program the application area from a hex file.  Byte addresses in the file are twice the word address.
+        /// </summary>
+        static void Preload(BootloaderModel model, HexData hex)
+        {
+            for (int address = model.NewResetVector; address < BootloaderModel.EndFlash; ++address)
+            {
+                uint low = (uint)address * 2;
+                if (hex.ContainsAny(low, 2))
+                {
+                    byte l = hex.Contains(low) ? hex[low] : (byte)0xFF;
+                    byte h = hex.Contains(low + 1) ? hex[low + 1] : (byte)0xFF;
+                    model.Preload(address, (ushort)(l | (h << 8)));
+                }
+            }
+        }
+
+        static int UsageError(string message)
+        {
+            Console.Error.WriteLine(message);
+            Console.Error.WriteLine(UsageText);
+            return 2;
+        }
+    }
+}
@@ -0,0 +1,344 @@
+﻿using System;
+using System.Collections.Generic;
+using System.Diagnostics;
+using System.IO;
+using System.Runtime.InteropServices;
+using System.Text;
+using System.Threading;
+
+namespace PIC16F15214Emulator
+{
+    /// <summary>
+    ///  Thrown by PtyPort when the host resets the model by pulsing DTR, and by the model when its power fails.
+    ///  Closing the port is not a reset, as it is not on a board.
+    /// </summary>
+    class TargetResetException : Exception
+    {
+    }
+
+    /// <summary>
+    ///  The model's EUSART: the master side of a Linux pseudo-terminal.  The host opens the slave side
+    ///  (SlaveName) as if it were a USB serial port.  With Realtime set, bytes take as long as they would at
+    ///  Baud and Delay stalls as long as the part would, so the host can be timed against the emulator;
+    ///  otherwise everything happens as fast as the pty allows.
+    /// </summary>
+    class PtyPort : IDisposable
+    {
+        const int O_RDWR = 0x0002;
+        const int O_NOCTTY = 0x0100;
+        const short POLLIN = 0x0001;
+        const short POLLHUP = 0x0010;
+        const int TCSANOW = 0;
+        const ulong TIOCGWINSZ = 0x5413;
+        const uint B115200 = 0x1002;
+        const uint B230400 = 0x1003;
+        const uint B460800 = 0x1004;
+        const uint B1000000 = 0x1008;
+        /// How often to look for the host while the port is closed
+        const int HostPollMs = 20;
+        /// Realtime pacing sleeps only once the model is this far ahead of the clock
+        const double SleepThreshold = 0.002;
+
+        [StructLayout(LayoutKind.Sequential)]
+        struct PollFd
+        {
+            public int fd;
+            public short events;
+            public short revents;
+        }
+
+        [DllImport("libc", SetLastError = true)]
+        static extern int posix_openpt(int flags);
+        [DllImport("libc", SetLastError = true)]
+        static extern int grantpt(int fd);
+        [DllImport("libc", SetLastError = true)]
+        static extern int unlockpt(int fd);
+        [DllImport("libc", SetLastError = true)]
+        static extern int ptsname_r(int fd, byte[] buf, UIntPtr buflen);
+        [DllImport("libc", SetLastError = true)]
+        static extern int open(string pathname, int flags);
+        [DllImport("libc", SetLastError = true)]
+        static extern int close(int fd);
+        [DllImport("libc", SetLastError = true)]
+        static extern IntPtr read(int fd, byte[] buf, UIntPtr count);
+        [DllImport("libc", SetLastError = true)]
+        static extern IntPtr write(int fd, byte[] buf, UIntPtr count);
+        [DllImport("libc", SetLastError = true)]
+        static extern int poll([In, Out] PollFd[] fds, UIntPtr nfds, int timeout);
+        [DllImport("libc", SetLastError = true)]
+        static extern int tcgetattr(int fd, byte[] termios);
+        [DllImport("libc", SetLastError = true)]
+        static extern int tcsetattr(int fd, int optional_actions, byte[] termios);
+        [DllImport("libc")]
+        static extern void cfmakeraw(byte[] termios);
+        [DllImport("libc")]
+        static extern uint cfgetospeed(byte[] termios);
+        [DllImport("libc", SetLastError = true)]
+        static extern int ioctl(int fd, ulong request, ushort[] winsize);
+
+        readonly int _master;
+        readonly byte[] _input = new byte[256];
+        int _inputStart = 0;
+        int _inputEnd = 0;
+        readonly List<byte> _output = new List<byte>();
+        readonly PollFd[] _poll = new PollFd[1];
+        /// Set while the host has the port open
+        bool _connected = false;
+        /// ws_row, ws_col, ws_xpixel, ws_ypixel.  ptymodem.c counts DTR releases in ws_ypixel.
+        readonly ushort[] _winsize = new ushort[4];
+        ushort _dtrReleases = 0;
+
+        readonly Stopwatch _clock = Stopwatch.StartNew();
+        /// Where the modelled part has got to, in seconds on _clock.  Ahead of the clock while the line is busy.
+        double _deviceTime = 0;
+
+        public PtyPort()
+        {
+            _master = posix_openpt(O_RDWR | O_NOCTTY);
+            if (_master < 0 || grantpt(_master) != 0 || unlockpt(_master) != 0)
+            {
+                throw new IOException($"Cannot create a pseudo-terminal (errno {Marshal.GetLastWin32Error()})");
+            }
+            byte[] name = new byte[128];
+            if (ptsname_r(_master, name, (UIntPtr)name.Length) != 0)
+            {
+                throw new IOException($"Cannot name the pseudo-terminal (errno {Marshal.GetLastWin32Error()})");
+            }
+            SlaveName = Encoding.ASCII.GetString(name, 0, Array.IndexOf(name, (byte)0));
+
+            // Raw from the start, so a banner written before the host opens the port is not echoed back to the model
+            int slave = open(SlaveName, O_RDWR | O_NOCTTY);
+            byte[] termios = new byte[64];
+            if (slave < 0 || tcgetattr(slave, termios) != 0)
+            {
+                throw new IOException($"Cannot open {SlaveName} (errno {Marshal.GetLastWin32Error()})");
+            }
+            cfmakeraw(termios);
+            tcsetattr(slave, TCSANOW, termios);
+            close(slave);
+            _poll[0].fd = _master;
+            _poll[0].events = POLLIN;
+            ioctl(_master, TIOCGWINSZ, _winsize);
+            _dtrReleases = _winsize[3];
+        }
+
+        /// Path the host opens, e.g. /dev/pts/3
+        public string SlaveName { get; }
+
+        /// Pace the line and stalls as the part would
+        public bool Realtime { get; set; }
+
+        /// Baud rate used for pacing, and the model's own rate
+        public int Baud { get; set; } = 115200;
+
+        /// <summary>
+        ///  The rate the host has set its end of the pty to, or 0 if it is not one the bootloader uses.  A pty
+        ///  passes bytes whatever the rate, so the model compares this with Baud to see a framing error.
+        /// </summary>
+        public int HostBaud
+        {
+            get
+            {
+                byte[] termios = new byte[64];
+                if (tcgetattr(_master, termios) != 0)
+                {
+                    return 0;
+                }
+                switch (cfgetospeed(termios))
+                {
+                    case B115200: return 115200;
+                    case B230400: return 230400;
+                    case B460800: return 460800;
+                    case B1000000: return 1000000;
+                    default: return 0;
+                }
+            }
+        }
+
+        /// <summary>
+        ///  Start over after a reset: anything the host sent to the old session is dropped.
+        /// </summary>
+        public void Reset()
+        {
+            _inputStart = _inputEnd = 0;
+            _output.Clear();
+            _deviceTime = _clock.Elapsed.TotalSeconds;
+        }
+
+        /// <summary>
+        ///  Wait for the host to open the port.
+        /// </summary>
+        public void WaitForHost()
+        {
+            Flush();
+            while (!Poll(HostPollMs) && !_connected)
+            {
+            }
+        }
+
+        /// <summary>
+        ///  Wait for a byte (EUSART1_Read).  Throws TargetResetException if the host resets the model.
+        /// </summary>
+        public byte Read()
+        {
+            int b;
+            while ((b = Read(-1)) < 0)
+            {
+            }
+            return (byte)b;
+        }
+
+        /// <summary>
+        ///  Wait up to timeoutMs (-1 for ever) for a byte and return it, or -1 if none came.
+        /// </summary>
+        public int Read(int timeoutMs)
+        {
+            if (_inputStart == _inputEnd)
+            {
+                Flush();
+                Stopwatch waited = Stopwatch.StartNew();
+                while (true)
+                {
+                    int remaining = (timeoutMs < 0) ? HostPollMs : (int)Math.Max(0, timeoutMs - waited.ElapsedMilliseconds);
+                    if (Poll(Math.Min(remaining, HostPollMs)))
+                    {
+                        break;
+                    }
+                    if (timeoutMs >= 0 && waited.ElapsedMilliseconds >= timeoutMs)
+                    {
+                        return (-1);
+                    }
+                }
+                long count = (long)read(_master, _input, (UIntPtr)_input.Length);
+                if (count <= 0)
+                {
+                    LostHost();
+                    return (-1);
+                }
+                _inputStart = 0;
+                _inputEnd = (int)count;
+                // The part was idle until this arrived
+                _deviceTime = Math.Max(_deviceTime, _clock.Elapsed.TotalSeconds);
+            }
+            Spend(ByteTime);
+            return _input[_inputStart++];
+        }
+
+        /// <summary>
+        ///  Queue a byte (EUSART1_Write).  Bytes go out when the model next waits for input or stalls.
+        /// </summary>
+        public void Write(byte b)
+        {
+            _output.Add(b);
+            Spend(ByteTime);
+        }
+
+        public void Write(string text)
+        {
+            foreach (char c in text)
+            {
+                Write((byte)c);
+            }
+        }
+
+        /// <summary>
+        ///  The CPU stalls for the given time, as it does for a flash erase or write.
+        /// </summary>
+        public void Delay(double seconds)
+        {
+            Flush();
+            Spend(seconds);
+        }
+
+        /// <summary>
+        ///  Seconds since the port was created, on the model's clock.
+        /// </summary>
+        public double Now
+        {
+            get { return Realtime ? _deviceTime : _clock.Elapsed.TotalSeconds; }
+        }
+
+        /// Ten bits per byte: start, eight data, stop
+        double ByteTime
+        {
+            get { return 10.0 / Baud; }
+        }
+
+        private void Spend(double seconds)
+        {
+            if (!Realtime)
+            {
+                return;
+            }
+            _deviceTime += seconds;
+            double ahead = _deviceTime - _clock.Elapsed.TotalSeconds;
+            if (ahead > SleepThreshold)
+            {
+                Flush();
+                Thread.Sleep(TimeSpan.FromSeconds(ahead));
+            }
+        }
+
+        private void Flush()
+        {
+            if (_output.Count == 0)
+            {
+                return;
+            }
+            // Written even while the host has the port closed: the pty keeps it, as a USB serial adapter would not,
+            // but the host discards its input before every handshake anyway.
+            byte[] data = _output.ToArray();
+            _output.Clear();
+            int done = 0;
+            while (done < data.Length)
+            {
+                byte[] rest = (done == 0) ? data : data[done..];
+                long count = (long)write(_master, rest, (UIntPtr)rest.Length);
+                if (count <= 0)
+                {
+                    break;
+                }
+                done += (int)count;
+            }
+        }
+
+        /// <summary>
+        ///  Wait up to timeoutMs for input and return true if there is some.  Notices the host opening and closing the
+        ///  port, and pulsing DTR.
+        /// </summary>
+        private bool Poll(int timeoutMs)
+        {
+            _poll[0].revents = 0;
+            if (poll(_poll, (UIntPtr)1, timeoutMs) < 0)
+            {
+                return (false);
+            }
+            if ((_poll[0].revents & POLLHUP) != 0)
+            {
+                // No one has the slave open
+                LostHost();
+                Thread.Sleep(timeoutMs);
+                return (false);
+            }
+            _connected = true;
+            if (ioctl(_master, TIOCGWINSZ, _winsize) == 0 && _winsize[3] != _dtrReleases)
+            {
+                // The host ran with ptymodem.c and released DTR, as at the end of a reset pulse
+                _dtrReleases = _winsize[3];
+                throw new TargetResetException();
+            }
+            return ((_poll[0].revents & POLLIN) != 0);
+        }
+
+        /// The host closed the port.  The model carries on, and sees the next host's bytes when it opens the port.
+        private void LostHost()
+        {
+            _connected = false;
+        }
+
+        public void Dispose()
+        {
+            close(_master);
+        }
+    }
+}
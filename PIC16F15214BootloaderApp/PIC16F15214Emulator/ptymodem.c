@@ -0,0 +1,93 @@
+/*
+ * LD_PRELOAD shim so that hosts which set DTR and RTS when they open a port, as System.IO.Ports does, can open
+ * the emulator's pseudo-terminal.  A pty has no modem lines and rejects TIOCMGET and friends with ENOTTY; here
+ * those calls succeed instead, and the lines read back as last set.  The lines are kept in the pty's own window
+ * size, which the master side can read, so each pty has its own and a gang of ports can each be reset alone:
+ * ws_xpixel holds the lines and ws_ypixel counts DTR releases, so the emulator sees even a pulse shorter than it
+ * polls.  That is the reset of --reset.
+ *
+ *   gcc -shared -fPIC -O2 -o libptymodem.so ptymodem.c -ldl
+ *   LD_PRELOAD=$PWD/libptymodem.so PIC16F15214Flash --port /dev/pts/3 --image app.hex
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <sys/ioctl.h>
+
+/// Set in ws_xpixel once the lines have been stored there, to tell them from the 0 of a new pty
+#define LINES_STORED 0x8000
+/// Lines a pty reads back before the host has set any
+#define DEFAULT_LINES (TIOCM_DSR | TIOCM_CTS | TIOCM_CAR)
+
+/// The lines of fd as last set, kept in its own window size so that each pty has its own.  -1 if fd has no window size.
+static int GetLines(int (*realIoctl)(int, unsigned long, ...), int fd)
+{
+	struct winsize size;
+
+	if (realIoctl(fd, TIOCGWINSZ, &size) != 0)
+	{
+		return (-1);
+	}
+	return ((size.ws_xpixel & LINES_STORED) ? (size.ws_xpixel & ~LINES_STORED) : DEFAULT_LINES);
+}
+
+/// Store the lines in the window size of fd, counting a reset each time DTR is released.
+static void Publish(int (*realIoctl)(int, unsigned long, ...), int fd, int previous, int lines)
+{
+	struct winsize size;
+
+	if (realIoctl(fd, TIOCGWINSZ, &size) == 0)
+	{
+		size.ws_xpixel = (unsigned short)(lines | LINES_STORED);
+		if ((previous & TIOCM_DTR) && !(lines & TIOCM_DTR))
+		{
+			++size.ws_ypixel;
+		}
+		realIoctl(fd, TIOCSWINSZ, &size);
+	}
+}
+
+int ioctl(int fd, unsigned long request, ...)
+{
+	static int (*realIoctl)(int, unsigned long, ...);
+	va_list args;
+	void *arg;
+	int result;
+	int lines;
+
+	va_start(args, request);
+	arg = va_arg(args, void *);
+	va_end(args);
+	if (!realIoctl)
+	{
+		realIoctl = (int (*)(int, unsigned long, ...))dlsym(RTLD_NEXT, "ioctl");
+	}
+	result = realIoctl(fd, request, arg);
+	if (result < 0 && errno == ENOTTY && arg != 0 &&
+			(request == TIOCMGET || request == TIOCMSET || request == TIOCMBIS || request == TIOCMBIC))
+	{
+		lines = GetLines(realIoctl, fd);
+		if (lines < 0)
+		{
+			errno = ENOTTY;  // Not a pty either
+			return (result);
+		}
+		switch (request)
+		{
+			case TIOCMGET:
+				*(int *)arg = lines;
+				return (0);
+			case TIOCMSET:
+				Publish(realIoctl, fd, lines, *(int *)arg);
+				return (0);
+			case TIOCMBIS:
+				Publish(realIoctl, fd, lines, lines | *(int *)arg);
+				return (0);
+			case TIOCMBIC:
+				Publish(realIoctl, fd, lines, lines & ~*(int *)arg);
+				return (0);
+		}
+	}
+	return (result);
+}
@@ -0,0 +1,111 @@
+/*
+ * A host that only knows the 0xF6 session, as the original PC app did: it sends the application area from 0x140
+ * whatever the bootloader's application start, then checks the readback.  The image is linked for 0x400, so
+ * the words below 0x400 are 0x3FFF and each word above holds a pattern of its own address, which shows up any
+ * shift.  The last word is the 0x14B7 marker.  Run against an emulator that is staying in boot:
+ *
+ *   legacy_host /dev/pts/3
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <termios.h>
+#include <unistd.h>
+
+#define LEGACY_RESET_VECTOR 0x140
+#define IMAGE_START 0x400
+#define END_FLASH 0x1000
+#define ROW_WORDS 32
+
+/// The word the image holds at address
+static unsigned Word(unsigned address)
+{
+	if (address == END_FLASH - 1)
+	{
+		return (0x14B7);
+	}
+	return ((address < IMAGE_START) ? 0x3FFF : (address * 7) & 0x3FFF);
+}
+
+/// Read one byte, or -1 after a second of silence
+static int ReadByte(int fd)
+{
+	unsigned char b;
+
+	return ((read(fd, &b, 1) == 1) ? b : -1);
+}
+
+/// Skip input until the byte expected arrives.  Returns 0, or 1 after a second of silence.
+static int Expect(int fd, int expected)
+{
+	int b;
+
+	while ((b = ReadByte(fd)) != expected)
+	{
+		if (b < 0)
+		{
+			fprintf(stderr, "No '%c'\n", expected);
+			return (1);
+		}
+	}
+	return (0);
+}
+
+int main(int argc, char **argv)
+{
+	static const unsigned char handshake[] = { 0x52, 0xA3, 0x4D, 0xF6 };
+	unsigned char row[ROW_WORDS * 2];
+	struct termios termios;
+	unsigned address;
+	unsigned word;
+	int low;
+	int high;
+	int i;
+	int fd;
+
+	if (argc != 2 || (fd = open(argv[1], O_RDWR | O_NOCTTY)) < 0 || tcgetattr(fd, &termios) != 0)
+	{
+		fprintf(stderr, "Usage: legacy_host <port>\n");
+		return (2);
+	}
+	cfmakeraw(&termios);
+	termios.c_cc[VMIN] = 0;
+	termios.c_cc[VTIME] = 10;
+	tcsetattr(fd, TCSANOW, &termios);
+
+	write(fd, handshake, sizeof(handshake));
+	if (Expect(fd, 'e') || Expect(fd, 'W'))
+	{
+		return (1);
+	}
+	for (address = LEGACY_RESET_VECTOR; address < END_FLASH; address += ROW_WORDS)
+	{
+		for (i = 0; i < ROW_WORDS; ++i)
+		{
+			row[2 * i] = (unsigned char)Word(address + i);
+			row[2 * i + 1] = (unsigned char)(Word(address + i) >> 8);
+		}
+		write(fd, row, sizeof(row));
+		if (ReadByte(fd) != 'W')
+		{
+			fprintf(stderr, "No 'W' after the row at 0x%X\n", address);
+			return (1);
+		}
+	}
+	if (ReadByte(fd) != 'R')
+	{
+		fprintf(stderr, "No readback\n");
+		return (1);
+	}
+	for (address = LEGACY_RESET_VECTOR; address < END_FLASH; ++address)
+	{
+		low = ReadByte(fd);
+		high = ReadByte(fd);
+		word = (unsigned)low | ((unsigned)high << 8);
+		if (low < 0 || high < 0 || word != Word(address))
+		{
+			fprintf(stderr, "Read back 0x%X at 0x%X, sent 0x%X\n", word, address, Word(address));
+			return (1);
+		}
+	}
+	return (0);
+}
@@ -0,0 +1,52 @@
+/*
+ * Checks that ptymodem.c keeps the modem lines of each pty apart.  Run with the shim preloaded, as regression.sh does:
+ * it raises DTR on two ptys, releases it on each in turn, and expects each pty to count its own release.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define PTYS 2
+
+int main(void)
+{
+	int master[PTYS];
+	int slave[PTYS];
+	int dtr = TIOCM_DTR;
+	int lines;
+	struct winsize size;
+	int i;
+
+	for (i = 0; i < PTYS; ++i)
+	{
+		master[i] = posix_openpt(O_RDWR | O_NOCTTY);
+		if (master[i] < 0 || grantpt(master[i]) != 0 || unlockpt(master[i]) != 0 ||
+				(slave[i] = open(ptsname(master[i]), O_RDWR | O_NOCTTY)) < 0)
+		{
+			perror("pty");
+			return (2);
+		}
+		if (ioctl(slave[i], TIOCMBIS, &dtr) != 0)
+		{
+			perror("TIOCMBIS (is ptymodem.c preloaded?)");
+			return (2);
+		}
+	}
+	for (i = 0; i < PTYS; ++i)
+	{
+		ioctl(slave[i], TIOCMBIC, &dtr);
+	}
+	for (i = 0; i < PTYS; ++i)
+	{
+		if (ioctl(master[i], TIOCGWINSZ, &size) != 0 || size.ws_ypixel != 1 ||
+				ioctl(slave[i], TIOCMGET, &lines) != 0 || (lines & TIOCM_DTR) || !(lines & TIOCM_DSR))
+		{
+			fprintf(stderr, "pty %d: %u DTR releases, lines 0x%X\n", i, size.ws_ypixel, lines);
+			return (1);
+		}
+	}
+	return (0);
+}
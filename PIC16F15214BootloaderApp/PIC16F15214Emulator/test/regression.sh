@@ -0,0 +1,169 @@
+#!/bin/bash
+#
+# Regression tests of the command line host against the emulator, and of ptymodem.c.  Needs gcc and the .Net SDK.
+# Run from any folder:
+#
+#   PIC16F15214BootloaderApp/PIC16F15214Emulator/test/regression.sh
+#
+# EMULATOR and FLASH may name prebuilt commands instead of "dotnet run".  Exits with the number of failed tests.
+
+here=$(cd "$(dirname "$0")" && pwd)
+app=$here/../../..
+EMULATOR=${EMULATOR:-"dotnet run --project $here/.. --"}
+FLASH=${FLASH:-"dotnet run --project $here/../../PIC16F15214Flash --"}
+sample=$app/ApplicationPIC16F15214.X/dist/default/production/ApplicationPIC16F15214.X.production.hex
+
+work=$(mktemp -d)
+emulators=
+trap 'stop_emulator; rm -rf "$work"' EXIT
+gcc -shared -fPIC -O2 -o "$work/libptymodem.so" "$here/../ptymodem.c" -ldl || exit 1
+failed=0
+
+# start_emulator <options>: sets port to the new emulator's pty.  Several may run at once.
+start_emulator()
+{
+	: > "$work/port"
+	$EMULATOR "$@" > "$work/port" 2>> "$work/emulator.log" &
+	emulators="$emulators $!"
+	for i in $(seq 300); do
+		[ -s "$work/port" ] && break
+		sleep 0.1
+	done
+	port=$(head -n 1 "$work/port")
+}
+
+# stop_emulator: stop every emulator that is running
+stop_emulator()
+{
+	for emulator in $emulators; do
+		kill "$emulator" 2> /dev/null && wait "$emulator" 2> /dev/null
+	done
+	emulators=
+}
+
+# flash <expected exit code> <options>
+flash()
+{
+	local expected=$1
+	shift
+	LD_PRELOAD=$work/libptymodem.so timeout 60 $FLASH --port "$port" "$@" > "$work/flash.out"
+	local code=$?
+	if [ $code -ne "$expected" ]; then
+		echo "    PIC16F15214Flash $* exited with $code, expected $expected: $(cat "$work/flash.out")"
+		return 1
+	fi
+}
+
+# check <name> <result>: report one test
+check()
+{
+	if [ "$2" -eq 0 ]; then
+		echo "PASS $1"
+	else
+		echo "FAIL $1"
+		failed=$((failed + 1))
+	fi
+}
+
+# The application is running and its listen window catches the host's first 0xF7 without --reset.  The host
+# must end up in the command session; falling back to 0xF6 would write a 0x140 based image from 0x400.
+start_emulator --extended --autoboot-window 50 --flash "$here/app400.hex"
+flash 0 --image "$here/app400-update.hex" && flash 0 --image "$here/app400-update.hex" --mode check
+check "extended, listen window, no --reset" $?
+stop_emulator
+
+# The window's 0xF7 is answered with the banner, then 'c' and the application start, with no second handshake
+start_emulator --extended --autoboot-window 50 --flash "$here/app400.hex"
+reply=$(exec 3<> "$port"; stty -F "$port" raw -echo; printf '\x52\xA3\x4D\xF7' >&3; timeout 2 head -c 11 <&3 | od -An -tx1 | tr -d ' \n')
+[ "$reply" = "45424f4f54543e3e630004" ]
+result=$?
+[ $result -eq 0 ] || echo "    Reply to 0xF7 in the window was '$reply'"
+check "extended, listen window answers 0xF7 at once" $result
+stop_emulator
+
+# The same for a bootloader without the command session: 0xF7 is ignored after the banner and 0xF6 starts the download
+start_emulator --autoboot-window 50 --flash "$sample"
+flash 0 --image "$sample"
+check "default, listen window, no --reset" $?
+stop_emulator
+
+# An image linked for 0x140 is refused by an extended bootloader before anything is written
+start_emulator --extended --stay
+flash 0 --image "$here/app400.hex" && flash 3 --image "$sample" && flash 0 --image "$here/app400.hex" --mode check
+check "extended, image linked for 0x140 refused" $?
+stop_emulator
+
+# A host that only knows 0xF6 sends the area from 0x140.  An extended bootloader must write it from 0x400 at the
+# right addresses, not shifted down by 0x2C0 words, and read it back the same way.
+start_emulator --extended --stay
+gcc -o "$work/legacy_host" "$here/legacy_host.c" && "$work/legacy_host" "$port"
+check "extended, 0xF6 session from an old host" $?
+stop_emulator
+
+# With APP_CRC_CHECK the image the host downloads passes the boot time check: after a reset the board only stays
+# in boot for the listen window ('T'), not for a bad check value ('C').
+start_emulator --app-crc-check --autoboot-window 50 --flash "$here/app400.hex"
+flash 0 --image "$here/app400-update.hex" && flash 0 --reset --image "$here/app400-update.hex" --mode check &&
+	grep -q "reason 'T'" "$work/flash.out"
+check "extended, APP_CRC_CHECK passes after a download" $?
+stop_emulator
+
+# Power fails straight after the first row of an update.  The host writes the marker row first with the marker
+# blank, so the board stays in boot ('L') instead of starting a mix of the two images, and the next download
+# finishes the update.  The first download gets the banner where the row's acknowledge should be, and fails.
+: > "$work/emulator.log"
+start_emulator --extended --verbose --autoboot-window 50 --power-fail 1 --flash "$here/app400.hex"
+flash 1 --image "$here/app400-update.hex"
+result=$?
+after=$(sed -n '/Power failed/,$p' "$work/emulator.log" | grep -m 1 '^Reset')
+echo "$after" | grep -q "staying in boot ('L')" || { echo "    After the power failure: '$after'"; result=1; }
+[ $result -eq 0 ] && flash 0 --image "$here/app400-update.hex" && flash 0 --image "$here/app400-update.hex" --mode check
+check "extended, power fails after one row of an update" $?
+stop_emulator
+
+# Closing the port does not reset a board, so the next host finds the last one's session still running.  The
+# download leaves it at 1000000 baud, and the check's handshake at 115200 must bring it back.  The check leaves
+# it at 115200, where the next handshake's 0x52 must not be taken as 'R'.
+: > "$work/emulator.log"
+start_emulator --extended --verbose --stay --flash "$here/app400.hex"
+flash 0 --image "$here/app400-update.hex" && flash 0 --image "$here/app400-update.hex" --mode check
+result=$?
+grep -q "Framing error" "$work/emulator.log" || { echo "    No framing error at 1000000 baud"; result=1; }
+reply=$(exec 3<> "$port"; stty -F "$port" raw -echo; printf '\x52\xA3\x4D\xF7' >&3; timeout 2 head -c 3 <&3 | od -An -tx1 | tr -d ' \n')
+[ "$reply" = "630004" ] || { echo "    Reply to a second 0xF7 at 115200 was '$reply'"; result=1; }
+[ $(grep -c "^Reset" "$work/emulator.log") -eq 1 ] || { echo "    The model was reset"; result=1; }
+check "extended, a new host joins a running session" $result
+stop_emulator
+
+# A hex file whose records end with a lone CR, as some old tools write them, loads the same as one with LF
+start_emulator --extended --stay --flash "$here/app400.hex"
+tr '\n' '\r' < "$here/app400-update.hex" | tr -s '\r' > "$work/cr.hex"
+flash 0 --image "$work/cr.hex" && flash 0 --image "$here/app400-update.hex" --mode check
+check "extended, hex file with CR line ends" $?
+stop_emulator
+
+# A 'C' range that ends above flash is refused with '?', not read until NVMADR wraps, and the next 'C' is answered
+start_emulator --extended
+reply=$(exec 3<> "$port"; stty -F "$port" raw -echo; printf '\x52\xA3\x4D\xF7C\x00\x04\x00\x80C\x00\x04\x00\x10' >&3; timeout 2 head -c 15 <&3 | od -An -tx1 | tr -d ' \n')
+echo "$reply" | grep -q "6300043f43....$"
+result=$?
+[ $result -eq 0 ] || echo "    Replies to 'C' were '$reply'"
+check "extended, 'C' refuses a range beyond flash" $result
+stop_emulator
+
+# The shim keeps each pty's modem lines apart, so one port's DTR pulse is not seen by another
+gcc -o "$work/ptymodem_test" "$here/ptymodem_test.c" && LD_PRELOAD=$work/libptymodem.so "$work/ptymodem_test"
+check "ptymodem.c keeps each pty's lines" $?
+
+# A gang reset pulses DTR on every port at once.  Each pty keeps its own lines, so every board sees its own pulse.
+ports=
+for i in 1 2 3 4; do
+	start_emulator --extended --autoboot-window 50 --flash "$here/app400.hex"
+	ports=$ports${ports:+,}$port
+done
+port=$ports
+flash 0 --reset --image "$here/app400-update.hex"
+check "extended, gang of four with --reset" $?
+stop_emulator
+
+exit $failed
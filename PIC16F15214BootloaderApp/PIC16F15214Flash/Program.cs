@@ -0,0 +1,233 @@
+﻿using System;
+using System.Collections.Generic;
+using System.IO;
+using System.Linq;
+using System.Text;
+using System.Threading;
+using PIC16F15214BootloaderApp;
+
+namespace PIC16F15214Flash
+{
+    /// <summary>
+    ///  Command line front end to the Windows app's download engine, for scripts, build servers and production
+    ///  controllers.  Prints one line of key=value pairs per port on stdout and exits with an ExitCode.
+    /// </summary>
+    static class Program
+    {
+        /// Process exit codes.  With several ports the highest one any port earned is returned.
+        enum ExitCode
+        {
+            Success = 0,
+            /// A board was not programmed, or does not match the image
+            Failed = 1,
+            /// Bad command line
+            Usage = 2,
+            /// The hex file could not be read, has nothing for the board's application area or is linked for another
+            Image = 3,
+            /// A port could not be opened or failed during the session
+            Port = 4,
+            /// A bootloader did not answer, or stopped answering
+            Timeout = 5,
+            /// Interrupted with Ctrl+C
+            Cancelled = 6,
+        }
+
+        const string UsageText =
+@"Usage: PIC16F15214Flash --port <port>[,<port>...] --image <file.hex> [options]
+
+  -p, --port <ports>    Serial port, e.g. /dev/ttyUSB0.  Several ports, comma separated
+                        or given with more than one --port, are programmed at once.
+  -i, --image <file>    Intel hex image for the application area.
+  -m, --mode <mode>     program  Write the rows that differ and verify them (default).
+                        check    Only compare the board with the image.
+  -r, --reset           Reset the target with DTR and RTS first.  Needs a bootloader
+                        built with AUTOBOOT_WINDOW_MS.
+      --full-readback   Verify by reading the whole application area back.
+  -t, --timing          Fetch the bootloader's own timing and print the timing report
+                        to stderr.
+  -v, --verbose         Print each port's progress to stderr.
+
+Prints one line per port on stdout:
+  port=<port> result=<result> code=<n> elapsed_ms=<n> <step>_ms=<n>... status=""<text>""
+Exit codes: 0 success, 1 failed, 2 usage, 3 image, 4 port, 5 timeout, 6 cancelled.";
+
+        /// <summary>
+        ///  Writes each new status line to stderr, prefixed with the port.
+        /// </summary>
+        class StatusPrinter : IProgress<DownloadProgress>
+        {
+            readonly string _port;
+            string _last = null;
+
+            public StatusPrinter(string port)
+            {
+                _port = port;
+            }
+
+            public void Report(DownloadProgress value)
+            {
+                if (value.Status != _last)
+                {
+                    _last = value.Status;
+                    Console.Error.WriteLine($"{_port}: {value.Status}");
+                }
+            }
+        }
+
+        static int Main(string[] args)
+        {
+            List<string> ports = new List<string>();
+            string image = null;
+            DownloadOptions options = new DownloadOptions();
+            bool timing = false;
+            bool verbose = false;
+
+            for (int i = 0; i < args.Length; ++i)
+            {
+                switch (args[i])
+                {
+                    case "-p":
+                    case "--port":
+                        if (++i < args.Length)
+                        {
+                            ports.AddRange(args[i].Split(',', StringSplitOptions.RemoveEmptyEntries));
+                        }
+                        break;
+                    case "-i":
+                    case "--image":
+                        image = (++i < args.Length) ? args[i] : null;
+                        break;
+                    case "-m":
+                    case "--mode":
+                        string mode = (++i < args.Length) ? args[i] : null;
+                        if (mode != "program" && mode != "check")
+                        {
+                            return UsageError($"Unknown mode '{mode}'");
+                        }
+                        options.CheckOnly = (mode == "check");
+                        break;
+                    case "-r":
+                    case "--reset":
+                        options.ResetTarget = true;
+                        break;
+                    case "--full-readback":
+                        options.FullReadback = true;
+                        break;
+                    case "-t":
+                    case "--timing":
+                        timing = true;
+                        options.DeviceTiming = true;
+                        break;
+                    case "-v":
+                    case "--verbose":
+                        verbose = true;
+                        break;
+                    case "-h":
+                    case "--help":
+                        Console.WriteLine(UsageText);
+                        return (int)ExitCode.Success;
+                    default:
+                        return UsageError($"Unknown option '{args[i]}'");
+                }
+            }
+            if (ports.Count == 0 || image == null)
+            {
+                return UsageError("A port and an image are required");
+            }
+
+            Firmware firmware;
+            try
+            {
+                firmware = new Firmware(image);
+            }
+            catch (Exception ex)
+            {
+                Console.Error.WriteLine($"{image}: {ex.Message}");
+                return (int)ExitCode.Image;
+            }
+
+            using CancellationTokenSource cancel = new CancellationTokenSource();
+            Console.CancelKeyPress += (sender, e) =>
+            {
+                // Let the sessions stop between rows and close their ports
+                e.Cancel = true;
+                cancel.Cancel();
+            };
+            DownloadEngine[] engines = ports.Select(port => new DownloadEngine(port)).ToArray();
+            IProgress<DownloadProgress>[] progress = verbose ? ports.Select(port => new StatusPrinter(port)).ToArray() : null;
+            DownloadResult[] results = GangDownload.DownloadAsync(engines, firmware, options, progress, cancel.Token).GetAwaiter().GetResult();
+
+            ExitCode exit = ExitCode.Success;
+            foreach (DownloadResult result in results)
+            {
+                ExitCode code = Classify(result);
+                Console.WriteLine(Describe(result, code));
+                if (timing && result.Timing != null)
+                {
+                    Console.Error.WriteLine($"{result.PortName}:");
+                    Console.Error.Write(result.Timing.ToString());
+                }
+                if (code > exit)
+                {
+                    exit = code;
+                }
+            }
+            return (int)exit;
+        }
+
+        static int UsageError(string message)
+        {
+            Console.Error.WriteLine(message);
+            Console.Error.WriteLine(UsageText);
+            return (int)ExitCode.Usage;
+        }
+
+        static ExitCode Classify(DownloadResult result)
+        {
+            if (result.Success)
+            {
+                return ExitCode.Success;
+            }
+            switch (result.Exception)
+            {
+                case OperationCanceledException _:
+                    return ExitCode.Cancelled;
+                case TimeoutException _:
+                    return ExitCode.Timeout;
+                case InvalidDataException _:  // Before IOException, which it derives from
+                    return ExitCode.Image;
+                case IOException _:
+                case UnauthorizedAccessException _:
+                    return ExitCode.Port;
+                default:
+                    return ExitCode.Failed;
+            }
+        }
+
+        /// <summary>
+        ///  One port's result as key=value pairs.  Host steps become &lt;step&gt;_ms keys, e.g. "Row hashes" is row_hashes_ms.
+        /// </summary>
+        static string Describe(DownloadResult result, ExitCode code)
+        {
+            StringBuilder line = new StringBuilder();
+            string outcome = result.AlreadyCurrent ? "current" : code.ToString().ToLowerInvariant();
+            line.Append($"port={result.PortName} result={outcome} code={(int)code}");
+            line.Append(FormattableString.Invariant($" elapsed_ms={result.Elapsed.TotalMilliseconds:F0}"));
+            if (result.Timing != null)
+            {
+                foreach (KeyValuePair<string, TimeSpan> step in result.Timing.Steps)
+                {
+                    string key = step.Key.ToLowerInvariant().Replace(' ', '_');
+                    line.Append(FormattableString.Invariant($" {key}_ms={step.Value.TotalMilliseconds:F0}"));
+                }
+            }
+            if (result.Info != null)
+            {
+                line.Append($" device=0x{result.Info.DeviceId:X4} revision=0x{result.Info.RevisionId:X4}");
+                line.Append($" bootloader={result.Info.BootloaderVersion} reason={result.Info.BootloadReason}");
+            }
+            line.Append($" status=\"{result.Status?.Replace('"', '\'')}\"");
+            return line.ToString();
+        }
+    }
+}